@@ -1,76 +1,79 @@
-import numpy as np 
+import numpy as np
 import cv2
 
 WIDTH = 44
-HEIGHT = 2 * int(0.43 * WIDTH) 
-
-POS = "\033[{};{}H"
-FG = "\033[38;2;{};{};{}m"
-BG = "\033[48;2;{};{};{}m"
-CR = "\033[0m"
-HB = "▄"
+HEIGHT = 2 * int(0.43 * WIDTH)
 
 is_transparent = lambda clr1, clr2: clr1[3] == 0 and clr2[3] == 0
 
 def bgr_to_console(clr):
     result = np.array((0, 0, 0))
     alpha = clr[3] / 255.0
-    result = (alpha * clr[:3] + (1 - alpha) * result).astype(np.uint8) 
-    return result[::-1]
+    result = (alpha * clr[:3] + (1 - alpha) * result).astype(np.uint8)
+    return tuple(int(c) for c in result[::-1])
 
-def convert_frame(frame_path):
+# A frame is a list of rows of cells, a cell is None when transparent or a
+# (lower half, upper half) pair of RGB tuples drawn as a lower half block
+def frame_cells(frame_path):
     image = cv2.imread(frame_path, cv2.IMREAD_UNCHANGED)
     image = cv2.resize(image, dsize=(WIDTH, HEIGHT), interpolation=cv2.INTER_CUBIC)
-    result = ""
-    lc1, lc2 = None, None
-    for y in range(0, HEIGHT, 2): 
-        result += POS.format(y // 2 + 1, 1)
+    cells = []
+    for y in range(0, HEIGHT, 2):
+        row = []
         for x in range(WIDTH):
             if is_transparent(image[y + 1, x], image[y, x]):
-                if lc1 is not None or lc2 is not None:
-                    lc1, lc2 = None, None
-                    result += CR
-                result += " "
-                continue
-            c1 = bgr_to_console(image[y + 1, x])
-            c2 = bgr_to_console(image[y, x])
-            if lc1 is None or not (c1 == lc1).all():
-                result += FG.format(*c1)
-                lc1 = c1
-            if lc2 is None or not (c2 == lc2).all():
-                result += BG.format(*c2)            
-                lc2 = c2
-            result += HB
-    return result
+                row.append(None)
+            else:
+                row.append((bgr_to_console(image[y + 1, x]), bgr_to_console(image[y, x])))
+        cells.append(row)
+    return cells
 
+# Cells are written as palette indices, index 0 is reserved for transparent
+# cells. hfetch builds the escape sequences from them at runtime.
+def write_header(path, frames):
+    palette = [(0, 0, 0)]
+    indices = {}
+    def palette_index(color):
+        if color not in indices:
+            indices[color] = len(palette)
+            palette.append(color)
+        return indices[color]
 
-"""
-print(convert_frame("./images/frame01.png"))
-#"""
+    rows = []
+    for cells in frames:
+        for row in cells:
+            rows.append(["{0,0}" if cell is None else
+                         f"{{{palette_index(cell[0])},{palette_index(cell[1])}}}" for cell in row])
+    assert len(palette) <= 65536, "palette does not fit animation_cell"
 
-#"""
-frame_paths = [f"./images/frame{i:02}.png" for i in range(1, 31)]
+    cfile = open(path, "w")
 
-cfile = open("../cliorb.h", "w")
+    cfile.write('#ifndef CLIORB_H\n')
+    cfile.write('#define CLIORB_H\n')
+    cfile.write('#include "hfetch.h"\n\n')
+    cfile.write('static const uint8_t cliorb_palette[][3] = {\n')
+    for i in range(0, len(palette), 8):
+        cfile.write(4 * ' ' + ','.join(f'{{{r},{g},{b}}}' for r, g, b in palette[i:i + 8]) + ',\n')
+    cfile.write('};\n\n')
+    cfile.write('static const animation_cell cliorb_cells[] = {\n')
+    for row in rows:
+        cfile.write(4 * ' ' + ','.join(row) + ',\n')
+    cfile.write('};\n\n')
+    cfile.write('animation_object cliorb = {\n')
+    cfile.write('    .current_frame = 0,\n')
+    cfile.write(f'    .frame_count = {len(frames)},\n')
+    cfile.write(f'    .width = {len(frames[0][0])},\n')
+    cfile.write(f'    .height = {len(frames[0])},\n')
+    cfile.write('    .palette = cliorb_palette,\n')
+    cfile.write(f'    .palette_size = {len(palette)},\n')
+    cfile.write('    .cells = cliorb_cells,\n')
+    cfile.write('};\n')
+    cfile.write('#endif\n')
+    cfile.close()
 
-cfile.write('#ifndef CLIORB_H\n')
-cfile.write('#define CLIORB_H\n')
-cfile.write('#include "hfetch.h"\n\n')
-cfile.write('animation_object cliorb = {\n')
-cfile.write('    .current_frame = 0,\n')
-cfile.write('    .frame_count = 30,\n')
-cfile.write('    .frames = {\n')
+    print(f"{len(palette)=}")
 
-max_len = 0
-for fp in frame_paths:
-    frame = repr(convert_frame(fp)).replace("'", '"')
-    cfile.write(8 * ' ' + frame + ',\n')
-    max_len = max(max_len, len(frame))
-    
-cfile.write('    }\n')
-cfile.write('};\n')
-cfile.write('#endif\n')
-cfile.close()
 
-print(f"{max_len=}")
-#"""
+if __name__ == "__main__":
+    frame_paths = [f"./images/frame{i:02}.png" for i in range(1, 31)]
+    write_header("../cliorb.h", [frame_cells(fp) for fp in frame_paths])
@@ -0,0 +1,700 @@
+// Microbenchmarks for the hfetch collectors, build and run with `make bench`
+#define HFETCH_NO_MAIN
+#include "../hfetch.c"
+
+#include <sys/stat.h>
+
+#define SYNTHETIC_PIDS 20000
+#define FIXTURES "bench/fixtures" // Relative to the repository, where make runs the benchmarks
+
+// Every heap allocation of the process, including those made inside libc,
+// goes through these and is counted
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+static atomic_size_t allocation_count = 0;
+
+void *malloc(size_t size) {
+    atomic_fetch_add_explicit(&allocation_count, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&allocation_count, 1, memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+    atomic_fetch_add_explicit(&allocation_count, 1, memory_order_relaxed);
+    return __libc_realloc(pointer, size);
+}
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Start of a measured loop, see report()
+typedef struct measurement {
+    double start_ns;
+    size_t allocations;
+} measurement;
+
+measurement start_measurement() {
+    return (measurement){ now_ns(), atomic_load(&allocation_count) };
+}
+
+// Time and allocations are read before printing, the first printf() allocates
+// the stdout buffer
+void report(const char *name, measurement start, size_t iterations) {
+    double elapsed_ns = now_ns() - start.start_ns;
+    size_t allocations = atomic_load(&allocation_count) - start.allocations;
+    printf("%-44s %10.0f ns/op %8.2f allocs/op  (%zu iterations)\n",
+        name, elapsed_ns / iterations, (double)allocations / iterations, iterations);
+}
+
+// Checks on what the parsers read from the fixtures, any failure fails the run
+static int failed_checks = 0;
+#define CHECK(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            failed_checks++; \
+        } \
+    } while (0)
+
+// Builds a /proc-like tree with SYNTHETIC_PIDS pid directories and a few
+// non-pid entries that the counters have to skip
+void make_synthetic_proc(char *root) {
+    char path[BUFFERSIZE];
+    for (int pid = 1; pid <= SYNTHETIC_PIDS; pid++) {
+        snprintf(path, BUFFERSIZE, "%s/%d", root, pid);
+        mkdir(path, 0755);
+    }
+    const char *others[] = { "self", "sys", "net", "irq", "driver" };
+    for (size_t i = 0; i < sizeof(others) / sizeof(*others); i++) {
+        snprintf(path, BUFFERSIZE, "%s/%s", root, others[i]);
+        mkdir(path, 0755);
+    }
+}
+
+void remove_synthetic_proc(char *root) {
+    char command[BUFFERSIZE];
+    snprintf(command, BUFFERSIZE, "rm -rf '%s'", root);
+    system(command);
+}
+
+long popen_count(const char *command) {
+    char buffer[BUFFERSIZE] = { 0 };
+    FILE *f = popen(command, "r");
+    if (!f)
+        return -1;
+    if (!fgets(buffer, BUFFERSIZE, f))
+        buffer[0] = '\0';
+    pclose(f);
+    return atol(buffer);
+}
+
+void bench_process_count() {
+    char root[] = "/tmp/hfetch-bench-XXXXXX";
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        return;
+    }
+    make_synthetic_proc(root);
+
+    char command[BUFFERSIZE];
+    snprintf(command, BUFFERSIZE, "ls -1 '%s' | grep -c '^[1-9]'", root);
+
+    int fd = -1;
+    long native = 0, spawned = 0;
+    size_t iterations = 200;
+    measurement start = start_measurement();
+    for (size_t i = 0; i < iterations; i++)
+        native = count_processes(&fd, root);
+    report("process count, getdents64 (synthetic)", start, iterations);
+    close(fd);
+
+    iterations = 20;
+    start = start_measurement();
+    for (size_t i = 0; i < iterations; i++)
+        spawned = popen_count(command);
+    report("process count, popen ls|grep (synthetic)", start, iterations);
+    printf("%-44s native %ld, popen %ld\n", "", native, spawned);
+
+    fd = -1;
+    iterations = 200;
+    start = start_measurement();
+    for (size_t i = 0; i < iterations; i++)
+        native = count_processes(&fd, "/proc");
+    report("process count, getdents64 (/proc)", start, iterations);
+    close(fd);
+
+    iterations = 20;
+    start = start_measurement();
+    for (size_t i = 0; i < iterations; i++)
+        spawned = popen_count("ps -aux | wc -l");
+    report("process count, popen ps|wc (/proc)", start, iterations);
+    printf("%-44s native %ld, popen %ld (includes header line)\n", "", native, spawned);
+
+    remove_synthetic_proc(root);
+}
+
+// Fills `buffer` with a /proc/stat of `cores` cores, `tick` advances the counters
+void make_synthetic_stat(char *buffer, size_t size, int cores, int tick) {
+    int written = snprintf(buffer, size, "cpu  %d 0 %d %d 0 0 0 0 0 0\n", cores * tick, cores * tick, cores * tick * 3);
+    for (int i = 0; i < cores && written < (int)size; i++)
+        written += snprintf(buffer + written, size - written, "cpu%d %d 3 %d %d 12 0 7 0 0 0\n",
+            i, tick * (i % 8), tick * (i % 5), tick * 100);
+    if (written < (int)size)
+        snprintf(buffer + written, size - written, "intr 1 0 0\nctxt 4242\nbtime 1700000000\n");
+}
+
+// Parse and per-core deltas on synthetic many-core machines, two samples
+// alternate so every iteration sees real deltas
+void bench_cpu_counters() {
+    static char samples[2][64 * 1024];
+    static float usage[1024];
+    const int core_counts[] = { 16, 256, 1024 };
+    for (size_t c = 0; c < sizeof(core_counts) / sizeof(*core_counts); c++) {
+        char name[BUFFERSIZE];
+        cpu_counters counters = { 0 };
+        for (int i = 0; i < 2; i++)
+            make_synthetic_stat(samples[i], sizeof(samples[i]), core_counts[c], i + 1);
+
+        size_t iterations = 20000;
+        measurement start = start_measurement();
+        for (size_t i = 0; i < iterations; i++) {
+            parse_cpu_stat(samples[i & 1], &counters);
+            compute_core_usage(&counters, usage);
+        }
+        snprintf(name, BUFFERSIZE, "cpu counters, parse + deltas (%d cores)", core_counts[c]);
+        report(name, start, iterations);
+
+        iterations = 200000;
+        start = start_measurement();
+        for (size_t i = 0; i < iterations; i++)
+            compute_core_usage(&counters, usage);
+        snprintf(name, BUFFERSIZE, "cpu counters, deltas only (%d cores)", core_counts[c]);
+        report(name, start, iterations);
+
+        free(counters.busy);
+        free(counters.total);
+        free(counters.prev_busy);
+        free(counters.prev_total);
+    }
+
+    // Busy ticks going backwards or outrunning the total are clamped to [0, 1]
+    uint64_t busy[] = { 5, 30, 10 }, total[] = { 20, 20, 20 };
+    uint64_t prev_busy[] = { 10, 0, 0 }, prev_total[] = { 10, 10, 20 };
+    cpu_counters skewed = { .busy = busy, .total = total, .prev_busy = prev_busy,
+                            .prev_total = prev_total, .count = 3 };
+    compute_core_usage(&skewed, usage);
+    CHECK(usage[0] == 0 && usage[1] == 1 && usage[2] == 0);
+}
+
+// Compares building the cliorb escape stream at runtime with copying
+// pre-rendered frames, which is what the static escape strings used to cost
+void bench_logo_encoder() {
+    const size_t frame_size = (size_t)cliorb.width * cliorb.height;
+    output_buffer prerendered[cliorb.frame_count];
+    memset(prerendered, 0, sizeof(prerendered));
+    for (size_t i = 0; i < cliorb.frame_count; i++)
+        encode_animation_frame(&cliorb, NULL, cliorb.cells + i * frame_size, &prerendered[i]);
+
+    output_buffer out = { 0 };
+    size_t iterations = 30000, bytes = 0;
+    measurement start = start_measurement();
+    for (size_t i = 0; i < iterations; i++) {
+        const output_buffer *frame = &prerendered[i % cliorb.frame_count];
+        out.length = 0;
+        append_output_buffer(&out, frame->data, frame->length);
+        bytes += out.length;
+    }
+    report("logo, copy static frame", start, iterations);
+    printf("%-44s %10zu bytes/frame\n", "", bytes / iterations);
+
+    bytes = 0;
+    start = start_measurement();
+    for (size_t i = 0; i < iterations; i++) {
+        out.length = 0;
+        encode_animation_frame(&cliorb, NULL, cliorb.cells + (i % cliorb.frame_count) * frame_size, &out);
+        bytes += out.length;
+    }
+    report("logo, encode keyframe", start, iterations);
+    printf("%-44s %10zu bytes/frame\n", "", bytes / iterations);
+
+    const char *mode_names[] = { "truecolor", "256", "16" };
+    for (color_mode mode = COLOR_MODE_TRUECOLOR; mode <= COLOR_MODE_16; mode++) {
+        char name[BUFFERSIZE];
+        set_animation_color_mode(&cliorb, mode);
+        out.length = 0;
+        yield_frame(&cliorb, &out);
+
+        bytes = 0;
+        start = start_measurement();
+        for (size_t i = 0; i < iterations; i++) {
+            out.length = 0;
+            yield_frame(&cliorb, &out);
+            bytes += out.length;
+        }
+        snprintf(name, BUFFERSIZE, "logo, encode delta (%s)", mode_names[mode]);
+        report(name, start, iterations);
+        size_t keyframe_bytes = 0;
+        for (size_t i = 0; i < cliorb.frame_count; i++)
+            keyframe_bytes += cliorb.keyframe_bytes[i];
+        printf("%-44s %10zu bytes/frame, repaint %zu bytes/frame\n", "", bytes / iterations,
+            keyframe_bytes / cliorb.frame_count);
+    }
+    set_animation_color_mode(&cliorb, COLOR_MODE_TRUECOLOR);
+
+    // Stripes filled in: every other cell changes and costs a cursor jump as
+    // a delta, the one-color repaint is shorter and is sent instead
+    static const uint8_t stripes_palette[3][3] = { { 0, 0, 0 }, { 200, 40, 40 }, { 40, 40, 200 } };
+    static animation_cell stripes_cells[2][4][32];
+    for (int y = 0; y < 4; y++)
+        for (int x = 0; x < 32; x++) {
+            stripes_cells[0][y][x] = (animation_cell){ 1 + (x & 1), 1 + (x & 1) };
+            stripes_cells[1][y][x] = (animation_cell){ 2, 2 };
+        }
+    animation_object stripes = { .frame_count = 2, .width = 32, .height = 4, .palette = stripes_palette,
+                                 .palette_size = 3, .cells = &stripes_cells[0][0][0] };
+    set_animation_color_mode(&stripes, COLOR_MODE_TRUECOLOR);
+    out.length = 0;
+    yield_frame(&stripes, &out);
+    out.length = 0;
+    yield_frame(&stripes, &out);
+    output_buffer delta = { 0 }, repaint = { 0 };
+    encode_animation_frame(&stripes, stripes.cells, stripes.cells + 32 * 4, &delta);
+    encode_animation_frame(&stripes, NULL, stripes.cells + 32 * 4, &repaint);
+    CHECK(repaint.length < delta.length && out.length == repaint.length);
+    free(delta.data);
+    free(repaint.data);
+    free(stripes.keyframe_bytes);
+
+    for (size_t i = 0; i < cliorb.frame_count; i++)
+        free(prerendered[i].data);
+    free(out.data);
+}
+
+// Reads a file of bench/fixtures into a NUL-terminated buffer
+char *load_fixture(const char *name) {
+    char path[BUFFERSIZE];
+    snprintf(path, BUFFERSIZE, FIXTURES "/%s", name);
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    rewind(f);
+    char *buffer = malloc(length + 1);
+    buffer[fread(buffer, 1, length, f)] = '\0';
+    fclose(f);
+    return buffer;
+}
+
+gpu_session *find_gpu_session(const char *tool) {
+    for (size_t i = 0; i < GPU_SESSION_COUNT; i++)
+        if (!strcmp(gpu_sessions[i].argv[0], tool))
+            return &gpu_sessions[i];
+    return NULL;
+}
+
+// Parsers fed with recorded /proc files and tool output instead of the live sources
+void bench_parsers() {
+    char *meminfo_text = load_fixture("proc/meminfo"),
+         *mounts_text = load_fixture("proc/mounts"),
+         *stat_text = load_fixture("proc/stat"),
+         *nvidia_smi_text = load_fixture("nvidia-smi.csv"),
+         *amdgpu_top_text = load_fixture("amdgpu_top.json");
+
+    meminfo_snapshot meminfo;
+    size_t iterations = 200000;
+    measurement start = start_measurement();
+    for (size_t i = 0; i < iterations; i++)
+        parse_meminfo(meminfo_text, &meminfo);
+    report("parse meminfo (fixture)", start, iterations);
+
+    mount_table table = { 0 };
+    parse_mount_table(mounts_text, &table);
+    iterations = 100000;
+    start = start_measurement();
+    for (size_t i = 0; i < iterations; i++)
+        parse_mount_table(mounts_text, &table);
+    report("parse mounts (fixture)", start, iterations);
+    printf("%-44s %10zu mounts listed\n", "", table.count);
+
+    // A container host lists far more than a page of mounts, seq_file hands
+    // them out about a page per read and the last one must not be lost
+    proc_source container_mounts = PROC_SOURCE(FIXTURES "/proc/mounts-container");
+    mount_table container_table = { 0 };
+    CHECK(read_proc_source(&container_mounts) && container_mounts.length > 4096);
+    parse_mount_table(container_mounts.buffer, &container_table);
+    CHECK(container_table.count
+        && !strcmp(container_table.entries[container_table.count - 1].mount_point, "/data"));
+    printf("%-44s %10zu mounts listed on a container host\n", "", container_table.count);
+    close_proc_source(&container_mounts);
+    free(container_table.entries);
+    proc_source smaps = PROC_SOURCE("/proc/self/smaps");
+    CHECK(read_proc_source(&smaps) && smaps.length > 4096);
+    close_proc_source(&smaps);
+
+    // statvfs() gets the decoded path, the disk line shows its control bytes as '?'
+    const mount_entry *odd = NULL;
+    for (size_t i = 0; i < table.count; i++)
+        if (!strcmp(table.entries[i].device, "/dev/sdc1"))
+            odd = &table.entries[i];
+    CHECK(odd && !strcmp(odd->mount_point, "/mnt/TAB\tNEW\nLINE"));
+    if (odd) {
+        mount_table odd_table = { .entries = (mount_entry *)odd, .count = 1, .capacity = 1 };
+        stats_snapshot odd_snapshot = { 0 };
+        sample_disks(&disks, &odd_table, &odd_snapshot);
+        CHECK(odd_snapshot.disk_count == 1
+            && !strcmp(odd_snapshot.disks[0].mount_point, "/mnt/TAB?NEW?LINE"));
+        free(odd_snapshot.disks);
+    }
+
+    cpu_counters counters = { 0 };
+    parse_cpu_stat(stat_text, &counters);
+    iterations = 200000;
+    start = start_measurement();
+    for (size_t i = 0; i < iterations; i++)
+        parse_cpu_stat(stat_text, &counters);
+    report("parse stat (fixture)", start, iterations);
+    printf("%-44s %10zu cores\n", "", counters.count);
+
+    // Copies, the sessions are only read from the table
+    gpu_session nvidia_smi = *find_gpu_session("nvidia-smi"),
+                amdgpu_top = *find_gpu_session("amdgpu_top");
+    gpu_session *sessions[] = { &nvidia_smi, &amdgpu_top };
+    char *texts[] = { nvidia_smi_text, amdgpu_top_text };
+    const char *names[] = { "parse nvidia-smi records (fixture)", "parse amdgpu_top records (fixture)" };
+    // One record per sample, what trails the last one is not a record
+    const size_t samples[] = { 60, 10 };
+    for (size_t j = 0; j < 2; j++) {
+        size_t length = strlen(texts[j]), consumed = 0;
+        sessions[j]->stream.record_count = 0;
+        iterations = 20000;
+        start = start_measurement();
+        for (size_t i = 0; i < iterations; i++)
+            consumed = parse_gpu_records(sessions[j], texts[j], length);
+        report(names[j], start, iterations);
+        printf("%-44s %10zu bytes, %zu records, %zu GPUs\n", "", consumed,
+            sessions[j]->stream.record_count / iterations, sessions[j]->gpu_count);
+        CHECK(sessions[j]->stream.record_count == samples[j] * iterations);
+    }
+
+    enumerate_drm_cards(FIXTURES "/drm");
+    gpu_stats gpu = { .activity = -1 };
+    iterations = 100000;
+    start = start_measurement();
+    for (size_t i = 0; i < iterations; i++)
+        fetch_drm_card(&drm_cards[0], &gpu);
+    report("read DRM card (fixture sysfs)", start, iterations);
+    printf("%-44s %10zu cards, %s\n", "", drm_card_count, gpu.name);
+
+    // card0 is an AMD card with every attribute, card1 an Intel card left to
+    // the tools, card2 has no vendor file and card3 is an AMD card without
+    // attributes. The connector and render node entries are not cards.
+    CHECK(drm_card_count == 4);
+    CHECK(!strcmp(drm_cards[0].vendor, "0x1002") && drm_cards[0].has_data);
+    CHECK(!strcmp(drm_cards[0].bus_id, "0000:03:00.0"));
+    CHECK(!strcmp(gpu.name, "AMD Radeon RX 7900 XTX"));
+    CHECK(gpu.vram_used_mib == 2048 && gpu.vram_total_mib == 24560 && gpu.activity == 7);
+    CHECK(!strcmp(drm_cards[1].vendor, "0x8086") && !drm_cards[1].has_data);
+    CHECK(!strcmp(drm_cards[1].name, "Intel GPU 0xa780 (card1)"));
+    CHECK(!strcmp(drm_cards[2].vendor, "unknown") && !drm_cards[2].has_data);
+    CHECK(!strcmp(drm_cards[2].name, "Unknown GPU 0x1234 (card2)"));
+    CHECK(!strcmp(drm_cards[3].vendor, "0x1002") && !drm_cards[3].has_data);
+
+    // amdgpu_top is started for card3 and lists card0 as well, which sysfs
+    // already covers
+    CHECK(gpu_session_needed(&amdgpu_top));
+    stats_snapshot gpus = { 0 };
+    add_session_gpus(&amdgpu_top, &gpus);
+    CHECK(gpus.gpu_count == 1 && !strcmp(gpus.gpus[0].name, "AMD Radeon Graphics"));
+    free(gpus.gpus);
+
+    free(meminfo_text);
+    free(mounts_text);
+    free(stat_text);
+    free(nvidia_smi_text);
+    free(amdgpu_top_text);
+}
+
+// Frame composition into the frame buffer, nothing is written to the terminal
+void bench_render() {
+    static system_stats stats = { 0 };
+    strcpy(stats.user_name, "user");
+    strcpy(stats.host_name, "workstation");
+    strcpy(stats.os_name, "Arch Linux");
+    strcpy(stats.kernel_version, "Linux-6.11.5-arch1-1");
+    strcpy(stats.desktop_name, "KDE (wayland)");
+    strcpy(stats.shell_name, "zsh");
+    strcpy(stats.terminal_name, "konsole");
+    strcpy(stats.cpu_name, "AMD Ryzen 7 7800X3D 8-Core Processor");
+
+    // A snapshot of the fixture machine
+    stats_snapshot *snapshot = &stats.working;
+    char *meminfo_text = load_fixture("proc/meminfo"), *stat_text = load_fixture("proc/stat");
+    cpu_counters counters = { 0 };
+    parse_cpu_stat(stat_text, &counters);
+    snapshot->core_usage = calloc(counters.count, sizeof(float));
+    snapshot->core_count = snapshot->core_capacity = counters.count;
+    for (size_t i = 0; i < counters.count; i++)
+        snapshot->core_usage[i] = (float)counters.busy[i] / counters.total[i];
+    snapshot->cpu_usage = 12;
+    parse_meminfo(meminfo_text, &snapshot->meminfo);
+    time(&snapshot->datetime);
+    snapshot->process_count = 412;
+    snapshot->uptime = 93784;
+    snapshot->battery_charge = -1;
+    const char *mounts[][2] = { { "/dev/nvme0n1p2", "/" }, { "/dev/nvme0n1p1", "/boot" }, { "/dev/sda1", "/mnt/storage" } };
+    for (size_t i = 0; i < 3; i++) {
+        disk_stats *disk = add_disk(snapshot);
+        strcpy(disk->device, mounts[i][0]);
+        strcpy(disk->mount_point, mounts[i][1]);
+        disk->total_bytes = 1000204886016ULL >> i;
+        disk->used_bytes = disk->total_bytes / 3;
+    }
+    gpu_stats *gpu = add_gpu(snapshot);
+    strcpy(gpu->name, "AMD Radeon RX 7900 XTX");
+    gpu->vram_used_mib = 2048;
+    gpu->vram_total_mib = 24560;
+    gpu->activity = 7;
+
+    // Warm up, sizes the frame buffer
+    begin_frame();
+    invalidate_render_cache(&stats_cache);
+    print_stats(&stats, snapshot);
+    print_logo();
+
+    size_t iterations = 50000, bytes = 0;
+    measurement start = start_measurement();
+    for (size_t i = 0; i < iterations; i++) {
+        begin_frame();
+        invalidate_render_cache(&stats_cache);
+        print_stats(&stats, snapshot);
+        bytes += frame_buffer.length;
+    }
+    report("print_stats, full redraw", start, iterations);
+    printf("%-44s %10zu bytes/frame\n", "", bytes / iterations);
+
+    iterations = 200000;
+    bytes = 0;
+    start = start_measurement();
+    for (size_t i = 0; i < iterations; i++) {
+        begin_frame();
+        print_stats(&stats, snapshot);
+        bytes += frame_buffer.length;
+    }
+    report("print_stats, unchanged", start, iterations);
+    printf("%-44s %10zu bytes/frame\n", "", bytes / iterations);
+
+    iterations = 30000;
+    bytes = 0;
+    start = start_measurement();
+    for (size_t i = 0; i < iterations; i++) {
+        begin_frame();
+        print_logo();
+        bytes += frame_buffer.length;
+    }
+    report("print_logo, animated", start, iterations);
+    printf("%-44s %10zu bytes/frame\n", "", bytes / iterations);
+    reset_animation(&cliorb);
+
+    free(meminfo_text);
+    free(stat_text);
+}
+
+// Runs every enabled collector once into snapshot and marks their fields ready
+void collect_all(stats_snapshot *snapshot) {
+    init_snapshot(snapshot);
+    for (size_t j = 0; j < COLLECTOR_COUNT; j++)
+        if (collectors[j].interval_ms) {
+            collectors[j].collect(snapshot);
+            snapshot->ready |= collectors[j].fields;
+        }
+}
+
+// Runs every collector and publishes the snapshot the way the stats thread does
+void refresh_all(system_stats *stats) {
+    for (size_t j = 0; j < COLLECTOR_COUNT; j++)
+        if (collectors[j].interval_ms)
+            collectors[j].collect(&stats->working);
+    copy_snapshot(&stats->snapshots[stats->back], &stats->working);
+    publish_snapshot(stats);
+}
+
+// Buffers and tables are reused, so once every snapshot slot has been sized
+// no refresh should allocate
+void bench_refresh_allocations() {
+    static system_stats stats = { 0 };
+    stats.flags.disable_print_gpu = TRUE; // No tool processes in a benchmark
+    fetch_stats(&stats);
+    wait_startup_jobs(&startup, COLLECTOR_EXPENSIVE);
+    absorb_startup_jobs(&startup, &stats);
+    for (int i = 0; i < 3; i++)
+        refresh_all(&stats);
+
+    size_t iterations = 200;
+    measurement start = start_measurement();
+    for (size_t i = 0; i < iterations; i++)
+        refresh_all(&stats);
+    report("refresh, all collectors", start, iterations);
+}
+
+// What the daemon pays to publish a snapshot and a client to copy it out
+void bench_shared_stats() {
+    static shared_stats segment = { .magic = SHARED_STATS_MAGIC, .size = sizeof(shared_stats) };
+    static stats_snapshot snapshot = { 0 }, copy = { 0 };
+    collect_all(&snapshot);
+    read_shared_stats(&segment, &copy);
+
+    size_t iterations = 200000;
+    measurement start = start_measurement();
+    for (size_t i = 0; i < iterations; i++)
+        write_shared_stats(&segment, &snapshot);
+    report("shared stats, seqlock write", start, iterations);
+
+    start = start_measurement();
+    for (size_t i = 0; i < iterations; i++)
+        read_shared_stats(&segment, &copy);
+    report("shared stats, seqlock read", start, iterations);
+    printf("%-44s %10zu disks, %zu cores\n", "", copy.disk_count, copy.core_count);
+}
+
+// Records of the headless --output mode, and the number formatting they use
+// compared with snprintf()
+void bench_metrics() {
+    static stats_snapshot snapshot = { 0 };
+    static output_buffer out = { 0 };
+    collect_all(&snapshot);
+    encode_json_record(&out, &snapshot, 0, 0);
+
+    size_t iterations = 200000;
+    measurement start = start_measurement();
+    for (size_t i = 0; i < iterations; i++) {
+        out.length = 0;
+        encode_json_record(&out, &snapshot, i, 1700000000000LL + i);
+    }
+    report("metrics, json record", start, iterations);
+    printf("%-44s %10zu bytes/record\n", "", out.length);
+
+    start = start_measurement();
+    for (size_t i = 0; i < iterations; i++) {
+        out.length = 0;
+        encode_binary_record(&out, &snapshot, i, 1700000000000LL + i);
+    }
+    report("metrics, binary record", start, iterations);
+    printf("%-44s %10zu bytes/record\n", "", out.length);
+
+    char number[32];
+    volatile char sink;
+    iterations = 2000000;
+    start = start_measurement();
+    for (size_t i = 0; i < iterations; i++) {
+        *format_hundredths(number, 1234567 + i) = '\0';
+        sink = number[0];
+    }
+    report("metrics, fixed-point number (hand-rolled)", start, iterations);
+    start = start_measurement();
+    for (size_t i = 0; i < iterations; i++) {
+        snprintf(number, sizeof(number), "%.2f", (1234567 + i) / 100.0);
+        sink = number[0];
+    }
+    report("metrics, fixed-point number (snprintf)", start, iterations);
+    (void)sink;
+
+    // Usage out of [0, 1] from a stray daemon segment is clamped, not converted as is
+    CHECK(core_usage_hundredths(-0.5f) == 0 && core_usage_hundredths(0.0f / 0.0f) == 0);
+    CHECK(core_usage_hundredths(7.0f) == 10000 && core_usage_hundredths(0.25f) == 2500);
+    CHECK(cpu_usage_hundredths(-1) == -1 && cpu_usage_hundredths(0.0 / 0.0) == -1);
+    CHECK(cpu_usage_hundredths(1e30) == 10000 && cpu_usage_hundredths(12.345) == 1235);
+}
+
+#define TRIPLE_BUFFER_PUBLISHES 2000000
+#define TAGGED_CORES 8
+
+static atomic_bool publisher_done;
+
+// Stats thread side: every field of snapshot k holds k
+void *publish_tagged_snapshots(void *data) {
+    system_stats *stats = data;
+    stats_snapshot *working = &stats->working;
+    working->core_usage = calloc(TAGGED_CORES, sizeof(float));
+    working->core_capacity = working->core_count = TAGGED_CORES;
+    working->disks = calloc(1, sizeof(disk_stats));
+    working->disk_capacity = working->disk_count = 1;
+    working->ready = SNAPSHOT_DATETIME | SNAPSHOT_UPTIME | SNAPSHOT_CPU | SNAPSHOT_MEMORY
+        | SNAPSHOT_PROCESSES | SNAPSHOT_DISKS;
+    for (long k = 1; k <= TRIPLE_BUFFER_PUBLISHES; k++) {
+        working->datetime = k;
+        working->uptime = k;
+        working->process_count = k;
+        working->cpu_usage = k;
+        working->meminfo.mem_total_kB = k;
+        for (int i = 0; i < TAGGED_CORES; i++)
+            working->core_usage[i] = k;
+        working->disks[0].used_bytes = k;
+        copy_snapshot(&stats->snapshots[stats->back], working);
+        publish_snapshot(stats);
+    }
+    atomic_store(&publisher_done, TRUE);
+    return NULL;
+}
+
+// Fails the run when the render side ever sees a snapshot mixing two
+// publishes, or an older snapshot after a newer one
+void bench_triple_buffer() {
+    static system_stats stats = { 0 };
+    stats.front = 0;
+    stats.back = 1;
+    atomic_init(&stats.middle, 2);
+    pthread_t publisher;
+    pthread_create(&publisher, NULL, publish_tagged_snapshots, &stats);
+
+    size_t reads = 0, torn = 0, reordered = 0;
+    long previous = 0;
+    measurement start = start_measurement();
+    BOOL last_pass = FALSE;
+    while (!last_pass) {
+        last_pass = atomic_load(&publisher_done);
+        const stats_snapshot *snapshot = acquire_snapshot(&stats);
+        reads++;
+        long k = snapshot->datetime;
+        if (k <= 0)
+            continue;
+        BOOL consistent = snapshot->uptime == k && snapshot->process_count == k && snapshot->cpu_usage == k
+            && snapshot->meminfo.mem_total_kB == (size_t)k && snapshot->core_count == TAGGED_CORES
+            && snapshot->disk_count == 1 && snapshot->disks[0].used_bytes == (size_t)k;
+        for (int i = 0; consistent && i < TAGGED_CORES; i++)
+            consistent = snapshot->core_usage[i] == k;
+        torn += !consistent;
+        reordered += k < previous;
+        previous = k;
+    }
+    report("triple buffer, acquire under contention", start, reads);
+    pthread_join(publisher, NULL);
+    printf("%-44s %10ld publishes, last read %ld, torn %zu, out of order %zu\n", "",
+        (long)TRIPLE_BUFFER_PUBLISHES, previous, torn, reordered);
+    if (torn || reordered || previous != TRIPLE_BUFFER_PUBLISHES) {
+        fprintf(stderr, "triple buffer handed out an inconsistent snapshot\n");
+        exit(1);
+    }
+}
+
+int main() {
+    bench_triple_buffer();
+    bench_refresh_allocations();
+    bench_shared_stats();
+    bench_metrics();
+    bench_parsers();
+    bench_render();
+    bench_cpu_counters();
+    bench_logo_encoder();
+    bench_process_count();
+    return failed_checks ? 1 : 0;
+}
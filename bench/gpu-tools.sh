@@ -0,0 +1,17 @@
+#!/bin/sh
+# Runs hfetch with the fake amdgpu_top and nvidia-smi in bench/fake-tools and
+# checks that every GPU of the recorded samples is reported. A "(" after the
+# name means the utilization was read.
+cd "$(dirname "$0")/.." || exit 1
+output=$(PATH="$PWD/bench/fake-tools:$PATH" ./hfetch --once --gpu-tools --local) || exit 1
+status=0
+for expected in "NVIDIA GeForce RTX 3080 (" "NVIDIA A100-SXM4-40GB" "NVIDIA GH200 480GB (" \
+                "AMD Radeon RX 7900 XTX (" "AMD Radeon Graphics ("; do
+    if printf '%s\n' "$output" | grep -qF "$expected"; then
+        echo "ok      $expected"
+    else
+        echo "missing $expected"
+        status=1
+    fi
+done
+exit $status
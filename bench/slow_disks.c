@@ -0,0 +1,86 @@
+// Disk sampling against a hung mount, build and run with `make check-slow-disks`.
+// statvfs() is wrapped at link time (-Wl,--wrap=statvfs): /fast answers at
+// once and /slow takes SLOW_STATVFS_MS, like a stalled NFS or FUSE mount.
+#define HFETCH_NO_MAIN
+#include "../hfetch.c"
+
+#define SLOW_STATVFS_MS 1000
+#define GIB (1024ULL * 1024 * 1024)
+
+int __real_statvfs(const char *path, struct statvfs *data);
+
+int __wrap_statvfs(const char *path, struct statvfs *data) {
+    if (strcmp(path, "/fast") && strcmp(path, "/slow"))
+        return __real_statvfs(path, data);
+    if (!strcmp(path, "/slow"))
+        usleep(SLOW_STATVFS_MS * 1000);
+    memset(data, 0, sizeof(*data));
+    data->f_frsize = 4096;
+    data->f_blocks = 100 * GIB / 4096;
+    data->f_bfree = 60 * GIB / 4096;
+    return 0;
+}
+
+static int failed_checks = 0;
+#define CHECK(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            failed_checks++; \
+        } \
+    } while (0)
+
+// Runs one refresh and returns how long it took in ms
+double refresh(mount_table *table, stats_snapshot *snapshot) {
+    snapshot->disk_count = 0;
+    long long start = monotonic_ns();
+    sample_disks(&disks, table, snapshot);
+    return (monotonic_ns() - start) / 1e6;
+}
+
+const disk_stats *find_disk(const stats_snapshot *snapshot, const char *mount_point) {
+    for (size_t i = 0; i < snapshot->disk_count; i++)
+        if (!strcmp(snapshot->disks[i].mount_point, mount_point))
+            return &snapshot->disks[i];
+    return NULL;
+}
+
+int main() {
+    static mount_entry entries[] = { { "/dev/sda1", "/fast" }, { "/dev/sdb1", "/slow" } };
+    mount_table table = { .entries = entries, .count = 2, .capacity = 2 };
+    stats_snapshot snapshot = { 0 };
+
+    // The first refresh gives up on /slow at the deadline, /fast is not held up
+    double ms = refresh(&table, &snapshot);
+    const disk_stats *fast = find_disk(&snapshot, "/fast"), *slow = find_disk(&snapshot, "/slow");
+    printf("first refresh: %.0f ms\n", ms);
+    CHECK(ms < DISK_SAMPLE_DEADLINE_MS + 100);
+    CHECK(fast && !fast->stale && fast->total_bytes == 100 * GIB && fast->used_bytes == 40 * GIB);
+    CHECK(slow && slow->stale && slow->total_bytes == 0);
+
+    // While its sample is still out, /slow is not queued again
+    ms = refresh(&table, &snapshot);
+    printf("second refresh: %.0f ms\n", ms);
+    CHECK(ms < DISK_SAMPLE_DEADLINE_MS + 100);
+    CHECK(find_disk(&snapshot, "/slow")->stale);
+
+    // Once the hung statvfs() returned, its value is shown
+    usleep(SLOW_STATVFS_MS * 1000);
+    ms = refresh(&table, &snapshot);
+    slow = find_disk(&snapshot, "/slow");
+    printf("after the slow mount answered: %.0f ms\n", ms);
+    CHECK(slow && slow->total_bytes == 100 * GIB);
+
+    // A mount that disappears while its sample is in flight is dropped from
+    // the pool, its worker frees the sample when statvfs() returns
+    refresh(&table, &snapshot);
+    table.count = 1;
+    refresh(&table, &snapshot);
+    CHECK(snapshot.disk_count == 1 && disks.sample_count == 1);
+    usleep((SLOW_STATVFS_MS + 100) * 1000);
+    refresh(&table, &snapshot);
+    CHECK(disks.sample_count == 1);
+    printf("samples after unmounting /slow: %zu\n", disks.sample_count);
+
+    printf("stale disk samples shown: %zu\n", disks.stale_count);
+    return failed_checks ? 1 : 0;
+}
@@ -0,0 +1,58 @@
+// Startup latency of a command, build and run with `make bench-startup`
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#define STARTUP_RUNS 50
+
+extern char **environ;
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Runs the command with its output discarded and returns the time until it exited
+double run_once(char **argv) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+    pid_t pid;
+    double start = now_ns();
+    int error = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error)
+        return -1;
+    int status;
+    waitpid(pid, &status, 0);
+    return now_ns() - start;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s command [arguments]\n", argv[0]);
+        return 1;
+    }
+    double min = -1, max = 0, total = 0;
+    for (int i = 0; i < STARTUP_RUNS; i++) {
+        double elapsed = run_once(argv + 1);
+        if (elapsed < 0) {
+            perror(argv[1]);
+            return 1;
+        }
+        if (min < 0 || elapsed < min)
+            min = elapsed;
+        if (elapsed > max)
+            max = elapsed;
+        total += elapsed;
+    }
+    printf("%s: min %.2f ms, avg %.2f ms, max %.2f ms (%d runs)\n",
+        argv[1], min / 1e6, total / STARTUP_RUNS / 1e6, max / 1e6, STARTUP_RUNS);
+    return 0;
+}
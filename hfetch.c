@@ -1,13 +1,27 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <time.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
-
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <termios.h>
+#include <ctype.h>
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <sys/utsname.h>
 #include <sys/sysinfo.h>
 #include <sys/statvfs.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "cliorb.h" // Cliorb animation object
 #include "hfetch.h"
@@ -36,10 +50,322 @@ static system_stats sysstats = { 0 };
 
 #define DEFAULTSTRING "Unknown"
 
-char *yield_frame(animation_object *ao) {
-    char *frame = ao->frames[ao->current_frame];
+// Pseudo-files re-read on every refresh, kept open for the program's lifetime
+static proc_source stat_source = PROC_SOURCE("/proc/stat");
+static proc_source meminfo_source = PROC_SOURCE("/proc/meminfo");
+static proc_source mounts_source = PROC_SOURCE("/proc/self/mounts");
+static proc_source battery_source = PROC_SOURCE("/sys/class/power_supply/BAT0/capacity");
+static cpu_counters cpu_table = { 0 };
+static size_t dynamic_refresh_count = 0;
+
+#ifdef HFETCH_PROFILE
+// Syscalls that have no counter of their own (proc sources, streams and
+// frames count theirs for --debug)
+static atomic_size_t statvfs_calls = 0, getdents_calls = 0, poll_calls = 0;
+static latency_histogram phase_latency[PHASE_COUNT] = { 0 };
+static const char *phase_names[PHASE_COUNT] = { "geometry", "stats", "logo", "write" };
+#endif
+
+long long monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Longest escape output of a single animation cell: a cursor jump, both colors
+// and the half block
+#define ANIMATION_CELL_MAX_BYTES 64
+
+char *write_uint(char *p, unsigned int value) {
+    char digits[10];
+    size_t n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (n)
+        *p++ = digits[--n];
+    return p;
+}
+
+// Restart from the keyframe, e.g. after the screen was cleared
+void reset_animation(animation_object *ao) {
+    ao->keyframe_drawn = FALSE;
+    ao->current_frame = 0;
+}
+
+// Levels of the xterm-256 6x6x6 color cube
+static const uint8_t cube_levels[6] = { 0, 95, 135, 175, 215, 255 };
+
+// The 16 basic ANSI colors as xterm draws them
+static const uint8_t ansi_palette[16][3] = {
+    { 0, 0, 0 }, { 205, 0, 0 }, { 0, 205, 0 }, { 205, 205, 0 },
+    { 0, 0, 238 }, { 205, 0, 205 }, { 0, 205, 205 }, { 229, 229, 229 },
+    { 127, 127, 127 }, { 255, 0, 0 }, { 0, 255, 0 }, { 255, 255, 0 },
+    { 92, 92, 255 }, { 255, 0, 255 }, { 0, 255, 255 }, { 255, 255, 255 },
+};
+
+int color_distance(const uint8_t a[3], const uint8_t b[3]) {
+    int distance = 0;
+    for (int c = 0; c < 3; c++)
+        distance += (a[c] - b[c]) * (a[c] - b[c]);
+    return distance;
+}
+
+// Nearest of the 6x6x6 cube and the 24 step gray ramp
+uint8_t quantize_256(const uint8_t rgb[3]) {
+    uint8_t cube[3];
+    int level[3];
+    for (int c = 0; c < 3; c++) {
+        level[c] = rgb[c] < 48 ? 0 : rgb[c] < 115 ? 1 : (rgb[c] - 35) / 40;
+        cube[c] = cube_levels[level[c]];
+    }
+
+    int gray_step = ((rgb[0] + rgb[1] + rgb[2]) / 3 - 3) / 10;
+    if (gray_step < 0) gray_step = 0;
+    if (gray_step > 23) gray_step = 23;
+    const uint8_t gray_level = 8 + 10 * gray_step;
+    const uint8_t gray[3] = { gray_level, gray_level, gray_level };
+
+    if (color_distance(rgb, gray) < color_distance(rgb, cube))
+        return 232 + gray_step;
+    return 16 + 36 * level[0] + 6 * level[1] + level[2];
+}
+
+uint8_t quantize_16(const uint8_t rgb[3]) {
+    uint8_t nearest = 0;
+    for (uint8_t i = 1; i < 16; i++)
+        if (color_distance(rgb, ansi_palette[i]) < color_distance(rgb, ansi_palette[nearest]))
+            nearest = i;
+    return nearest;
+}
+
+// Quantizes the whole palette once so encoding a frame only does table lookups
+void set_animation_color_mode(animation_object *ao, color_mode mode) {
+    ao->mode = mode;
+    free(ao->quantized);
+    ao->quantized = NULL;
+    free(ao->keyframe_bytes);
+    ao->keyframe_bytes = NULL;
+    if (mode != COLOR_MODE_TRUECOLOR) {
+        ao->quantized = malloc(ao->palette_size);
+        for (size_t i = 0; i < ao->palette_size; i++)
+            ao->quantized[i] = mode == COLOR_MODE_256 ? quantize_256(ao->palette[i]) : quantize_16(ao->palette[i]);
+    }
+    reset_animation(ao);
+}
+
+// Like set_animation_color_mode() but only the palette entries used by the
+// current frame are quantized, which is all a single frame needs
+void set_frame_color_mode(animation_object *ao, color_mode mode) {
+    ao->mode = mode;
+    free(ao->quantized);
+    ao->quantized = NULL;
+    free(ao->keyframe_bytes);
+    ao->keyframe_bytes = NULL;
+    if (mode == COLOR_MODE_TRUECOLOR)
+        return;
+    ao->quantized = malloc(ao->palette_size);
+    const size_t frame_size = (size_t)ao->width * ao->height;
+    const animation_cell *cells = ao->cells + ao->current_frame * frame_size;
+    for (size_t i = 0; i < frame_size; i++) {
+        const uint16_t indices[2] = { cells[i].fg, cells[i].bg };
+        for (int j = 0; j < 2; j++)
+            ao->quantized[indices[j]] = mode == COLOR_MODE_256
+                ? quantize_256(ao->palette[indices[j]]) : quantize_16(ao->palette[indices[j]]);
+    }
+}
+
+// Picks the most compact color mode the terminal is known to handle, unknown
+// terminals keep getting truecolor
+color_mode detect_color_mode() {
+    const char *colorterm = getenv("COLORTERM");
+    if (colorterm && (!strcmp(colorterm, "truecolor") || !strcmp(colorterm, "24bit")))
+        return COLOR_MODE_TRUECOLOR;
+
+    const char *term = getenv("TERM");
+    if (!term || strstr(term, "direct"))
+        return COLOR_MODE_TRUECOLOR;
+    if (strstr(term, "256color"))
+        return COLOR_MODE_256;
+    const char *basic_terms[] = { "linux", "vt", "ansi", "cons", "dumb", "screen", "tmux" };
+    for (size_t i = 0; i < sizeof(basic_terms) / sizeof(*basic_terms); i++)
+        if (!strncmp(term, basic_terms[i], strlen(basic_terms[i])))
+            return COLOR_MODE_16;
+    return COLOR_MODE_TRUECOLOR;
+}
+
+BOOL parse_color_mode(const char *name, color_mode *mode) {
+    if (!strcmp(name, "truecolor") || !strcmp(name, "24bit"))
+        *mode = COLOR_MODE_TRUECOLOR;
+    else if (!strcmp(name, "256"))
+        *mode = COLOR_MODE_256;
+    else if (!strcmp(name, "16"))
+        *mode = COLOR_MODE_16;
+    else
+        return FALSE;
+    return TRUE;
+}
+
+int animation_color_key(const animation_object *ao, uint16_t index) {
+    return ao->quantized ? ao->quantized[index] : index;
+}
+
+BOOL is_transparent_cell(const animation_cell *cell) {
+    return cell->fg == ANIMATION_TRANSPARENT && cell->bg == ANIMATION_TRANSPARENT;
+}
+
+// Cells look the same when they quantize to the same colors in the current mode
+BOOL cells_look_same(const animation_object *ao, const animation_cell *a, const animation_cell *b) {
+    if (is_transparent_cell(a) || is_transparent_cell(b))
+        return is_transparent_cell(a) && is_transparent_cell(b);
+    return animation_color_key(ao, a->fg) == animation_color_key(ao, b->fg) &&
+           animation_color_key(ao, a->bg) == animation_color_key(ao, b->bg);
+}
+
+char *write_animation_color(char *p, const animation_object *ao, BOOL background, uint16_t index) {
+    switch (ao->mode) {
+    case COLOR_MODE_256:
+        memcpy(p, background ? "\033[48;5;" : "\033[38;5;", 7);
+        p = write_uint(p + 7, ao->quantized[index]);
+        break;
+    case COLOR_MODE_16: {
+        const uint8_t color = ao->quantized[index];
+        *p++ = '\033';
+        *p++ = '[';
+        p = write_uint(p, (background ? 40 : 30) + (color & 7) + (color & 8 ? 60 : 0));
+        break;
+    }
+    default: {
+        const uint8_t *rgb = ao->palette[index];
+        memcpy(p, background ? "\033[48;2;" : "\033[38;2;", 7);
+        p = write_uint(p + 7, rgb[0]);
+        *p++ = ';';
+        p = write_uint(p, rgb[1]);
+        *p++ = ';';
+        p = write_uint(p, rgb[2]);
+        break;
+    }
+    }
+    *p++ = 'm';
+    return p;
+}
+
+// Color state of the encoder, otherwise a palette color key
+#define COLOR_STATE_UNKNOWN -1
+#define COLOR_STATE_RESET -2
+
+// Appends one cell at the cursor, `fg` and `bg` track the colors currently set
+char *write_animation_cell(char *p, const animation_object *ao, const animation_cell *cell, int *fg, int *bg) {
+    if (is_transparent_cell(cell)) {
+        if (*fg != COLOR_STATE_RESET || *bg != COLOR_STATE_RESET) {
+            *fg = *bg = COLOR_STATE_RESET;
+            memcpy(p, COLOR_RESET, sizeof(COLOR_RESET) - 1);
+            p += sizeof(COLOR_RESET) - 1;
+        }
+        *p++ = ' ';
+    } else {
+        if (animation_color_key(ao, cell->fg) != *fg) {
+            p = write_animation_color(p, ao, FALSE, cell->fg);
+            *fg = animation_color_key(ao, cell->fg);
+        }
+        if (animation_color_key(ao, cell->bg) != *bg) {
+            p = write_animation_color(p, ao, TRUE, cell->bg);
+            *bg = animation_color_key(ao, cell->bg);
+        }
+        memcpy(p, "▄", sizeof("▄") - 1);
+        p += sizeof("▄") - 1;
+    }
+    return p;
+}
+
+// Appends frame `cells` of an animation to `out`. Without `prev` every cell is
+// drawn, otherwise only the cells that differ from `prev` are, reached with
+// cursor jumps. The colors left by whatever was drawn before are unknown, so
+// the first cell always sets them.
+void encode_animation_frame(const animation_object *ao, const animation_cell *prev,
+                            const animation_cell *cells, output_buffer *out) {
+    int fg = COLOR_STATE_UNKNOWN, bg = COLOR_STATE_UNKNOWN;
+    int cursor_y = -1, cursor_x = -1;
+
+    reserve_output_buffer(out, (size_t)ao->width * ao->height * ANIMATION_CELL_MAX_BYTES);
+    char *p = out->data + out->length;
+
+    for (int y = 0; y < ao->height; y++) {
+        for (int x = 0; x < ao->width; x++) {
+            const animation_cell *cell = &cells[y * ao->width + x];
+            if (prev && cells_look_same(ao, &prev[y * ao->width + x], cell))
+                continue;
+
+            if (cursor_y != y || cursor_x != x) {
+                *p++ = '\033';
+                *p++ = '[';
+                if (cursor_y == y && prev) {
+                    p = write_uint(p, x - cursor_x);
+                    *p++ = 'C';
+                } else {
+                    p = write_uint(p, y + 1);
+                    *p++ = ';';
+                    p = write_uint(p, x + 1);
+                    *p++ = 'H';
+                }
+            }
+
+            p = write_animation_cell(p, ao, cell, &fg, &bg);
+            cursor_y = y;
+            cursor_x = x + 1;
+        }
+    }
+    out->length = p - out->data;
+}
+
+// Appends one row of the current frame at the cursor and resets the colors
+// after it, for output that is laid out line by line instead of positioned
+void encode_animation_row(const animation_object *ao, int y, output_buffer *out) {
+    const animation_cell *cells = ao->cells + (ao->current_frame * ao->height + y) * ao->width;
+    int fg = COLOR_STATE_UNKNOWN, bg = COLOR_STATE_UNKNOWN;
+    reserve_output_buffer(out, (size_t)ao->width * ANIMATION_CELL_MAX_BYTES + sizeof(COLOR_RESET));
+    char *p = out->data + out->length;
+    for (int x = 0; x < ao->width; x++)
+        p = write_animation_cell(p, ao, &cells[x], &fg, &bg);
+    memcpy(p, COLOR_RESET, sizeof(COLOR_RESET) - 1);
+    out->length = p + sizeof(COLOR_RESET) - 1 - out->data;
+}
+
+// A delta that changes most cells costs more than a repaint (cursor jumps
+// and colors set again after every gap), the repaint is sent instead then.
+// Repaint sizes are measured once per frame by encoding it after the delta.
+void yield_frame(animation_object *ao, output_buffer *out) {
+    const size_t frame_size = (size_t)ao->width * ao->height;
+    const animation_cell *cells = ao->cells + ao->current_frame * frame_size;
+    if (!ao->keyframe_drawn) {
+        ao->keyframe_drawn = TRUE;
+        encode_animation_frame(ao, NULL, cells, out);
+    } else {
+        if (!ao->keyframe_bytes)
+            ao->keyframe_bytes = calloc(ao->frame_count, sizeof(size_t));
+        size_t *keyframe_bytes = &ao->keyframe_bytes[ao->current_frame];
+        const size_t start = out->length;
+        encode_animation_frame(ao, ao->cells + ao->drawn_frame * frame_size, cells, out);
+        const size_t delta_bytes = out->length - start;
+        if (!*keyframe_bytes) {
+            encode_animation_frame(ao, NULL, cells, out);
+            *keyframe_bytes = out->length - start - delta_bytes;
+            if (*keyframe_bytes < delta_bytes)
+                memmove(out->data + start, out->data + start + delta_bytes, *keyframe_bytes);
+            out->length = start + (*keyframe_bytes < delta_bytes ? *keyframe_bytes : delta_bytes);
+        } else if (*keyframe_bytes < delta_bytes) {
+            out->length = start;
+            encode_animation_frame(ao, NULL, cells, out);
+        }
+    }
+    ao->drawn_frame = ao->current_frame;
     ao->current_frame = (ao->current_frame + 1) % (ao->frame_count);
-    return frame;
+}
+
+// Drops frames that were not drawn in time, the next delta spans the gap
+void skip_animation_frames(animation_object *ao, size_t count) {
+    ao->current_frame = (ao->current_frame + count) % ao->frame_count;
 }
 
 void fetch_user_name(char *user_name) {
@@ -62,15 +388,9 @@ void fetch_host_name(char *host_name) {
     }
 }
 
-void fetch_datetime(char *datetime) {
+void fetch_datetime(time_t *datetime) {
     NULL_RETURN(datetime);
-    strncpy(datetime, DEFAULTSTRING, BUFFERSIZE);
-
-    time_t dt;
-    if (time(&dt) != -1) {
-        struct tm *local = localtime(&dt);
-        strftime(datetime, BUFFERSIZE, "%Y-%m-%d %H:%M:%S", local);
-    }
+    time(datetime);
 }
 
 void fetch_os_name(char *os_name) {
@@ -157,8 +477,8 @@ void fetch_terminal_name(char *terminal_name) {
     if (!f)
         return;
     if (fgets(buffer, BUFFERSIZE, f) != NULL) {
+        buffer[strcspn(buffer, "\n")] = '\0';
         strncpy(terminal_name, buffer, BUFFERSIZE);
-        printf("%s", terminal_name);
     }
     fclose(f);
 }
@@ -186,240 +506,648 @@ void fetch_cpu_name(char *cpu_name) {
     fclose(f);
 }
 
-void fetch_cpu_usage(char *cpu_usage) {
-    NULL_RETURN(cpu_usage);
-    strncpy(cpu_usage, DEFAULTSTRING, BUFFERSIZE);
+// Parses an unsigned field after any spaces, a missing field reads as 0
+const char *parse_counter(const char *p, uint64_t *value) {
+    while (*p == ' ')
+        p++;
+    uint64_t v = 0;
+    while (*p >= '0' && *p <= '9')
+        v = v * 10 + (*p++ - '0');
+    *value = v;
+    return p;
+}
 
-    FILE *f = fopen("/proc/stat", "r");
-    if (!f)
+void reserve_cpu_counters(cpu_counters *counters, size_t count) {
+    if (count <= counters->capacity)
         return;
+    size_t capacity = counters->capacity ? counters->capacity : 64;
+    while (capacity < count)
+        capacity *= 2;
+    uint64_t **arrays[] = { &counters->busy, &counters->total, &counters->prev_busy, &counters->prev_total };
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(*arrays); i++)
+        *arrays[i] = realloc(*arrays[i], capacity * sizeof(uint64_t));
+    counters->capacity = capacity;
+}
 
-    static size_t prev_total = 0, prev_idle = 0;
-    char buffer[BUFFERSIZE];
-    if (fgets(buffer, BUFFERSIZE, f) != NULL) {
-        size_t user, nice, system, idle, iowait, irq, softirq, steal, guest, guest_nice;
-        sscanf(buffer, "cpu %zd %zd %zd %zd %zd %zd %zd %zd %zd %zd",
-            &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal, &guest, &guest_nice
-        );
-        size_t total = user + nice + system + idle + iowait + irq + softirq + steal + guest + guest_nice;
-        snprintf(cpu_usage, BUFFERSIZE,
-            "%.0f%%", (1 - (double)(idle - prev_idle) / (total - prev_total)) * 100
-        );
-        prev_total = total;
-        prev_idle = idle;
+// Parses the aggregate and every cpuN line of /proc/stat in one pass. The
+// previous sample is kept by swapping the arrays. When the number of cores
+// changes (CPU hotplug) they are compared against zero, like the first sample,
+// which covers the time since boot.
+void parse_cpu_stat(const char *buffer, cpu_counters *counters) {
+    uint64_t *swap = counters->prev_busy;
+    counters->prev_busy = counters->busy;
+    counters->busy = swap;
+    swap = counters->prev_total;
+    counters->prev_total = counters->total;
+    counters->total = swap;
+    counters->prev_aggregate_busy = counters->aggregate_busy;
+    counters->prev_aggregate_total = counters->aggregate_total;
+
+    size_t count = 0;
+    const char *p = buffer;
+    while (p && !strncmp(p, "cpu", 3)) {
+        BOOL aggregate = p[3] == ' ';
+        for (p += 3; *p >= '0' && *p <= '9'; p++);
+        // user nice system idle iowait irq softirq steal, guest time is
+        // already part of user and nice
+        uint64_t fields[8];
+        for (int i = 0; i < 8; i++)
+            p = parse_counter(p, &fields[i]);
+        uint64_t busy = fields[0] + fields[1] + fields[2] + fields[5] + fields[6] + fields[7];
+        uint64_t total = busy + fields[3] + fields[4];
+        if (aggregate) {
+            counters->aggregate_busy = busy;
+            counters->aggregate_total = total;
+        } else {
+            reserve_cpu_counters(counters, count + 1);
+            counters->busy[count] = busy;
+            counters->total[count] = total;
+            count++;
+        }
+        p = strchr(p, '\n');
+        if (p)
+            p++;
     }
+    if (count != counters->count) {
+        memset(counters->prev_busy, 0, count * sizeof(uint64_t));
+        memset(counters->prev_total, 0, count * sizeof(uint64_t));
+        counters->count = count;
+    }
+}
 
-    fclose(f);
+// Busy fraction of every core between the last two samples. Deltas are
+// signed as iowait is known to go backwards, a core without ticks reads 0
+// and the result is clamped to [0, 1] for the same reason.
+void compute_core_usage(const cpu_counters *counters, float *restrict usage) {
+    const uint64_t *restrict busy = counters->busy, *restrict total = counters->total,
+                   *restrict prev_busy = counters->prev_busy, *restrict prev_total = counters->prev_total;
+    for (size_t i = 0; i < counters->count; i++) {
+        int64_t busy_delta = busy[i] - prev_busy[i], total_delta = total[i] - prev_total[i];
+        // All ones when the core has ticks, otherwise 0 / 1 is computed. A mask
+        // instead of a branch or a float select keeps the loop vectorizable.
+        int64_t valid = -(int64_t)(total_delta > 0);
+        float fraction = (float)(busy_delta & valid) / (float)((total_delta & valid) | (~valid & 1));
+        // Compiled to min/max, not branches
+        fraction = fraction < 0 ? 0 : fraction;
+        usage[i] = fraction > 1 ? 1 : fraction;
+    }
 }
 
-void fetch_gpu_stats_multiple(char gpu_stats[BUFFERSIZE][3][BUFFERSIZE],size_t* gpu_count) {
-    NULL_RETURN(gpu_stats);
-    for(int i=0;i<BUFFERSIZE;i++)
-    {
-        strncpy(gpu_stats[i][0], DEFAULTSTRING, BUFFERSIZE);
-        strncpy(gpu_stats[i][1], DEFAULTSTRING, BUFFERSIZE);
+void fetch_cpu_usage(cpu_counters *counters, stats_snapshot *snapshot) {
+    NULL_RETURN(snapshot);
+    snapshot->cpu_usage = -1;
+    snapshot->core_count = 0;
+
+    if (!read_proc_source(&stat_source))
+        return;
+    parse_cpu_stat(stat_source.buffer, counters);
+    // Signed deltas and a clamp, as for the cores
+    int64_t busy_delta = counters->aggregate_busy - counters->prev_aggregate_busy,
+            total_delta = counters->aggregate_total - counters->prev_aggregate_total;
+    if (total_delta > 0) {
+        double usage = (double)busy_delta / total_delta * 100;
+        snapshot->cpu_usage = usage < 0 ? 0 : usage > 100 ? 100 : usage;
     }
 
-    size_t currentgpu = 0;
+    if (snapshot->core_capacity < counters->count) {
+        snapshot->core_capacity = counters->capacity;
+        snapshot->core_usage = realloc(snapshot->core_usage, snapshot->core_capacity * sizeof(float));
+    }
+    compute_core_usage(counters, snapshot->core_usage);
+    snapshot->core_count = counters->count;
+}
 
-    FILE *f = popen("amdgpu_top -d -gm", "r");
-    if (f)
-    {
-        dynamic_string amdgpu_top_output = new_dynamic_string("");
-        char buffer[BUFFERSIZE] = {0};
-        while(!feof(f))
-        {
-            fread(buffer,1,BUFFERSIZE,f);
-            append_dynamic_string(&amdgpu_top_output,buffer);
-        }
-        const char name_beginning_string[] = "device_name: \"";
-        const char name_end_string[] = "\",";
-		const char vramusage_beginning_string[] = ": usage";
-		const char vramtotal_beginning_string[] = " total";
-		const char vramtotal_end_string[] = "MiB";
-		const char gpuactivity_beginning_string[] = "average_gfx_activity: ";
-        char* amdgpu_top_string_iterator = amdgpu_top_output.str;
-        while(amdgpu_top_string_iterator = strstr(amdgpu_top_string_iterator,name_beginning_string))
-        {
-			char tempstr[64] = {0};
-			int i;
-
-			//get name
-            amdgpu_top_string_iterator+=sizeof(name_beginning_string)-1;
-            char* amdgpu_top_substr_end = strstr(amdgpu_top_string_iterator,name_end_string);
-			if(!amdgpu_top_substr_end) goto nextgpuamd;
-            strncpy(gpu_stats[currentgpu][0],amdgpu_top_string_iterator,(size_t)(amdgpu_top_substr_end-amdgpu_top_string_iterator));
-
-			//get used vram
-			amdgpu_top_string_iterator = strstr(amdgpu_top_string_iterator,vramusage_beginning_string);
-			if(!amdgpu_top_string_iterator) goto nextgpuamd;
-            amdgpu_top_string_iterator+=sizeof(vramusage_beginning_string)-1;
-			amdgpu_top_substr_end = strstr(amdgpu_top_string_iterator,vramtotal_beginning_string);
-			if(!amdgpu_top_substr_end) goto nextgpuamd;
-			i=0;
-			while(*amdgpu_top_string_iterator != ',')
-			{
-				if(*amdgpu_top_string_iterator >= '0' && *amdgpu_top_string_iterator <= '9')
-				{
-					tempstr[i++] = *amdgpu_top_string_iterator;
-				}
-				amdgpu_top_string_iterator++;
-			}
-			tempstr[i] = 0;
-			double usage = (double)atoi(tempstr);
-			usage/=1024.;
-			sprintf(tempstr,"%.2fGB / ",usage);
-			strcpy(gpu_stats[currentgpu][1],tempstr);
-
-			//get total vram
-			amdgpu_top_string_iterator = strstr(amdgpu_top_string_iterator,vramtotal_beginning_string);
-			if(!amdgpu_top_string_iterator) goto nextgpuamd;
-            amdgpu_top_string_iterator+=sizeof(vramtotal_beginning_string);
-			amdgpu_top_substr_end = strstr(amdgpu_top_string_iterator,vramtotal_end_string);
-			if(!amdgpu_top_substr_end) goto nextgpuamd;
-			i=0;
-			while(*amdgpu_top_string_iterator != '(' && *amdgpu_top_string_iterator != ')')
-			{
-				if(*amdgpu_top_string_iterator >= '0' && *amdgpu_top_string_iterator <= '9')
-				{
-					tempstr[i++] = *amdgpu_top_string_iterator;
-				}
-				amdgpu_top_string_iterator++;
-			}
-			tempstr[i] = 0;
-			double total = (double)atoi(tempstr);
-			total/=1024.;
-			sprintf(tempstr,"%.2fGB (%.0f%%)   ",total,(usage/total)*100.0);
-			strcat(gpu_stats[currentgpu][1],tempstr);
-
-			//get gpu activity
-			strstr(amdgpu_top_string_iterator,gpuactivity_beginning_string);
-			amdgpu_top_string_iterator = strstr(amdgpu_top_string_iterator,gpuactivity_beginning_string);
-			amdgpu_top_string_iterator+=sizeof(gpuactivity_beginning_string)-1;
-			i=1;
-			strcpy(tempstr,"(     ");
-			while(*amdgpu_top_string_iterator != ',')
-			{
-				if(*amdgpu_top_string_iterator >= '0' && *amdgpu_top_string_iterator <= '9')
-				{
-					tempstr[i++] = *amdgpu_top_string_iterator;
-				}
-				amdgpu_top_string_iterator++;
-			}
-			tempstr[i] = 0;
-			strcat(tempstr,"\%)  ");
-			strcpy(gpu_stats[currentgpu][2],tempstr);
-			
-			nextgpuamd:
-            	currentgpu++;
-        }
-		free_dynamic_string(&amdgpu_top_output);
+// Appends an entry to a snapshot table, growing it when full
+disk_stats *add_disk(stats_snapshot *snapshot) {
+    if (snapshot->disk_count == snapshot->disk_capacity) {
+        snapshot->disk_capacity = snapshot->disk_capacity ? snapshot->disk_capacity * 2 : 8;
+        snapshot->disks = realloc(snapshot->disks, snapshot->disk_capacity * sizeof(disk_stats));
     }
-    fclose(f);
+    disk_stats *disk = &snapshot->disks[snapshot->disk_count++];
+    memset(disk, 0, sizeof(*disk));
+    return disk;
+}
 
-    f = popen("nvidia-smi --query-gpu=name,memory.used,memory.total,utilization.gpu", "r");
-    if (f)
-    {
-        dynamic_string nvidia_smi_output = new_dynamic_string("");
-        char buffer[BUFFERSIZE] = {0};
-        while(!feof(f))
-        {
-            fread(buffer,1,BUFFERSIZE,f);
-            append_dynamic_string(&nvidia_smi_output,buffer);
+gpu_stats *add_gpu(stats_snapshot *snapshot) {
+    if (snapshot->gpu_count == snapshot->gpu_capacity) {
+        snapshot->gpu_capacity = snapshot->gpu_capacity ? snapshot->gpu_capacity * 2 : 4;
+        snapshot->gpus = realloc(snapshot->gpus, snapshot->gpu_capacity * sizeof(gpu_stats));
+    }
+    gpu_stats *gpu = &snapshot->gpus[snapshot->gpu_count++];
+    memset(gpu, 0, sizeof(*gpu));
+    strncpy(gpu->name, DEFAULTSTRING, BUFFERSIZE);
+    gpu->activity = -1;
+    return gpu;
+}
+
+// Copies at most BUFFERSIZE - 1 characters and always NUL-terminates
+void copy_field(char *dest, const char *src, size_t length) {
+    if (length > BUFFERSIZE - 1)
+        length = BUFFERSIZE - 1;
+    memcpy(dest, src, length);
+    dest[length] = '\0';
+}
+
+// Terminates a string and replaces the control bytes in it, they would
+// reach the terminal as escape sequences or break the line layout
+void strip_control_bytes(char *s, size_t size) {
+    s[size - 1] = '\0';
+    for (; *s; s++)
+        if ((unsigned char)*s < 0x20 || *s == 0x7f)
+            *s = '?';
+}
+
+// Records of `nvidia-smi --format=csv,noheader,nounits` are single lines
+size_t nvidia_smi_record_end(const char *data, size_t length) {
+    const char *end = memchr(data, '\n', length);
+    return end ? end - data + 1 : 0;
+}
+
+// Returns the end of the JSON object that starts at data (or 0 while it is
+// incomplete), braces inside strings are skipped
+size_t json_object_end(const char *data, size_t length) {
+    int depth = 0;
+    BOOL in_string = FALSE;
+    for (size_t i = 0; i < length; i++) {
+        if (in_string) {
+            if (data[i] == '\\')
+                i++;
+            else if (data[i] == '"')
+                in_string = FALSE;
+        } else if (data[i] == '"') {
+            in_string = TRUE;
+        } else if (data[i] == '{') {
+            depth++;
+        } else if (data[i] == '}' && --depth == 0) {
+            return i + 1;
         }
-        char* nvidia_string_iterator = nvidia_smi_output.str;
-		const char* separator_string = ", ";
-        while(nvidia_string_iterator = strstr(nvidia_string_iterator,"NVIDIA "))
-        {
-			char tempstr[64] = {0};
-			int i;
-
-			//get name
-            char* nvidia_substr_end = strstr(nvidia_string_iterator,separator_string);
-			if(!nvidia_substr_end) goto nextgpunvidia;
-            strncpy(gpu_stats[currentgpu][0],nvidia_string_iterator,(size_t)(nvidia_substr_end-nvidia_string_iterator));
-
-			//get used vram
-			nvidia_string_iterator = strstr(nvidia_string_iterator,separator_string);
-			if(!nvidia_string_iterator) goto nextgpunvidia;
-			i=0;
-			while(*nvidia_string_iterator != 'M')
-			{
-				if(*nvidia_string_iterator >= '0' && *nvidia_string_iterator <= '9')
-				{
-					tempstr[i++] = *nvidia_string_iterator;
-				}
-				nvidia_string_iterator++;
-			}
-			tempstr[i] = 0;
-			double usage = (double)atoi(tempstr);
-			usage/=1024.;
-			sprintf(tempstr,"%.2fGB / ",usage);
-			strcpy(gpu_stats[currentgpu][1],tempstr);
-
-			//get total vram
-			nvidia_string_iterator = strstr(nvidia_string_iterator,separator_string);
-			if(!nvidia_string_iterator) goto nextgpunvidia;
-			i=0;
-			while(*nvidia_string_iterator != 'M')
-			{
-				if(*nvidia_string_iterator >= '0' && *nvidia_string_iterator <= '9')
-				{
-					tempstr[i++] = *nvidia_string_iterator;
-				}
-				nvidia_string_iterator++;
-			}
-			tempstr[i] = 0;
-			double total = (double)atoi(tempstr);
-			total/=1024.;
-			sprintf(tempstr,"%.2fGB (%.0f%%)    ",total,(usage/total)*100.0);
-			strcat(gpu_stats[currentgpu][1],tempstr);
-
-			//get gpu activity
-			nvidia_string_iterator = strstr(nvidia_string_iterator,separator_string);
-			if(!nvidia_string_iterator) goto nextgpunvidia;
-			i=1;
-			strcpy(tempstr,"(     ");
-			while(*nvidia_string_iterator != '\%')
-			{
-				if(*nvidia_string_iterator >= '0' && *nvidia_string_iterator <= '9')
-				{
-					tempstr[i++] = *nvidia_string_iterator;
-				}
-				nvidia_string_iterator++;
-			}
-			tempstr[i] = 0;
-			strcat(tempstr,"\%)  ");
-			strcpy(gpu_stats[currentgpu][2],tempstr);
-
-			nextgpunvidia:
-            	currentgpu++;
-        }
-		free_dynamic_string(&nvidia_smi_output);
-    }
-    *gpu_count = currentgpu;
-    fclose(f);
+    }
+    return 0;
 }
 
-void fetch_ram_usage(char *ram_usage) {
-    NULL_RETURN(ram_usage);
-    strncpy(ram_usage, DEFAULTSTRING, BUFFERSIZE);
+// amdgpu_top -J writes one JSON object per sample, anything between objects is skipped.
+// Whitespace alone is not a record, it stays buffered until the next object.
+size_t amdgpu_top_record_end(const char *data, size_t length) {
+    size_t skipped = 0;
+    while (skipped < length && isspace((unsigned char)data[skipped]))
+        skipped++;
+    if (skipped == length)
+        return 0;
+    const char *start = memchr(data, '{', length);
+    if (!start)
+        return length;
+    size_t end = json_object_end(start, length - (start - data));
+    return end ? (start - data) + end : 0;
+}
 
-    FILE *f = fopen("/proc/meminfo", "r");
-    if (!f)
+// Reads a whole field as a number, FALSE for [N/A]
+BOOL parse_nvidia_smi_number(const char *field, const char *end, long *value) {
+    char *parsed;
+    *value = strtol(field, &parsed, 10);
+    return parsed != field && parsed == end;
+}
+
+// Parses "<index>, <name>, <vram used>, <vram total>, <gpu utilization>".
+// Any of the numbers can read [N/A] on its own, e.g. the memory fields of
+// unified memory GPUs (Grace Hopper, Jetson), which only leaves that field
+// unknown. The numbers are found from the end, names may contain ", ".
+void parse_nvidia_smi_record(gpu_session *session, char *record) {
+    char *it;
+    long index = strtol(record, &it, 10);
+    if (it == record || index < 0 || index >= GPU_SESSION_MAX_GPUS || strncmp(it, ", ", 2))
         return;
 
-    char buffer[BUFFERSIZE] = { 0 };
-    size_t total_kB = 0, used_kB = 0;
-    while (fgets(buffer, BUFFERSIZE, f) != NULL) {
-        if (total_kB && used_kB)
+    const char *name = it + 2, *field_end = record + strlen(record);
+    const char *fields[3], *ends[3];
+    for (int i = 2; i >= 0; i--) {
+        const char *separator = field_end - 2;
+        while (separator >= name && strncmp(separator, ", ", 2))
+            separator--;
+        if (separator < name)
+            return;
+        fields[i] = separator + 2;
+        ends[i] = field_end;
+        field_end = separator;
+    }
+
+    gpu_stats gpu = { .activity = -1 };
+    copy_field(gpu.name, name, field_end - name);
+    long used, total, activity;
+    // Usage is only shown next to a total
+    if (parse_nvidia_smi_number(fields[0], ends[0], &used) && parse_nvidia_smi_number(fields[1], ends[1], &total)
+        && used >= 0 && total > 0) {
+        gpu.vram_used_mib = used;
+        gpu.vram_total_mib = total;
+    }
+    if (parse_nvidia_smi_number(fields[2], ends[2], &activity) && activity >= 0)
+        gpu.activity = activity;
+    session->gpus[index] = gpu;
+    if ((size_t)index >= session->gpu_count)
+        session->gpu_count = index + 1;
+}
+
+// Finds "key": { ... "value": N } within object, returns -1 when absent or null
+double json_value(const char *object, const char *key) {
+    const char *it = strstr(object, key);
+    if (!it || !(it = strstr(it, "\"value\"")) || !(it = strchr(it, ':')))
+        return -1;
+    char *end;
+    double value = strtod(it + 1, &end);
+    return end == it + 1 ? -1 : value;
+}
+
+// Parses the "devices" array of an amdgpu_top -J sample, each device
+// object is cut out and NUL-terminated so its keys are searched in isolation
+void parse_amdgpu_top_record(gpu_session *session, char *record) {
+    char *it = strstr(record, "\"devices\"");
+    if (!it || !(it = strchr(it, '[')))
+        return;
+    session->gpu_count = 0;
+    while (session->gpu_count < GPU_SESSION_MAX_GPUS) {
+        it += strspn(it + 1, " \t\r\n,") + 1;
+        if (*it != '{')
+            break;
+        size_t length = json_object_end(it, strlen(it));
+        if (!length)
+            break;
+        char saved = it[length];
+        it[length] = '\0';
+
+        gpu_stats *gpu = &session->gpus[session->gpu_count++];
+        memset(gpu, 0, sizeof(*gpu));
+        strncpy(gpu->name, DEFAULTSTRING, BUFFERSIZE);
+        char *name = strstr(it, "\"DeviceName\"");
+        if (name && (name = strchr(name + 12, '"'))) {
+            char *name_end = strchr(++name, '"');
+            if (name_end)
+                copy_field(gpu->name, name, name_end - name);
+        }
+        double used = json_value(it, "\"Total VRAM Usage\""),
+               total = json_value(it, "\"Total VRAM\"");
+        if (used >= 0 && total > 0) {
+            gpu->vram_used_mib = used;
+            gpu->vram_total_mib = total;
+        }
+        char *activity = strstr(it, "\"gpu_activity\"");
+        gpu->activity = activity ? json_value(activity, "\"GFX\"") : -1;
+        char *bus_id = session->bus_ids[session->gpu_count - 1], *pci = strstr(it, "\"PCI\"");
+        bus_id[0] = '\0';
+        if (pci && (pci = strchr(pci + 5, '"'))) {
+            char *pci_end = strchr(++pci, '"');
+            if (pci_end && pci_end - pci < PCI_BUS_ID_SIZE) {
+                memcpy(bus_id, pci, pci_end - pci);
+                bus_id[pci_end - pci] = '\0';
+            }
+        }
+
+        it[length] = saved;
+        it += length - 1;
+    }
+}
+
+static drm_card drm_cards[DRM_MAX_CARDS];
+static size_t drm_card_count = 0;
+static BOOL drm_enumerated = FALSE; // The DRM class directory could be listed
+
+// Reads a small sysfs attribute that is only needed once
+BOOL read_attribute(const char *path, char *buffer, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return FALSE;
+    ssize_t n = read(fd, buffer, size - 1);
+    close(fd);
+    if (n <= 0)
+        return FALSE;
+    buffer[n] = '\0';
+    buffer[strcspn(buffer, "\n")] = '\0';
+    return TRUE;
+}
+
+// Finds KEY=value in a sysfs uevent file, e.g. PCI_SLOT_NAME
+BOOL read_uevent_value(const char *path, const char *key, char *value, size_t size) {
+    char buffer[1024];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return FALSE;
+    ssize_t n = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (n <= 0)
+        return FALSE;
+    buffer[n] = '\0';
+
+    size_t key_length = strlen(key);
+    for (char *line = buffer; *line; ) {
+        size_t length = strcspn(line, "\n");
+        if (!strncmp(line, key, key_length) && line[key_length] == '='
+            && length - key_length - 1 < size) {
+            memcpy(value, line + key_length + 1, length - key_length - 1);
+            value[length - key_length - 1] = '\0';
+            return TRUE;
+        }
+        line += length;
+        if (*line)
+            line++;
+    }
+    return FALSE;
+}
+
+void setup_drm_card(drm_card *card, const char *drm_root, const char *card_name) {
+    char path[BUFFERSIZE * 2], value[BUFFERSIZE];
+    memset(card, 0, sizeof(*card));
+
+    snprintf(path, sizeof(path), "%s/%s/device/vendor", drm_root, card_name);
+    if (!read_attribute(path, card->vendor, sizeof(card->vendor)))
+        snprintf(card->vendor, sizeof(card->vendor), "unknown");
+    snprintf(path, sizeof(path), "%s/%s/device/uevent", drm_root, card_name);
+    read_uevent_value(path, "PCI_SLOT_NAME", card->bus_id, sizeof(card->bus_id));
+
+    const char *attributes[3] = { "mem_info_vram_used", "mem_info_vram_total", "gpu_busy_percent" };
+    proc_source *sources[3] = { &card->vram_used, &card->vram_total, &card->busy_percent };
+    for (int i = 0; i < 3; i++) {
+        snprintf(card->paths[i], BUFFERSIZE, "%s/%s/device/%s", drm_root, card_name, attributes[i]);
+        *sources[i] = (proc_source)PROC_SOURCE(card->paths[i]);
+        if (!access(card->paths[i], R_OK))
+            card->has_data = TRUE;
+    }
+
+    // The kernel only knows marketing names for some cards, fall back to the PCI ids
+    snprintf(path, sizeof(path), "%s/%s/device/product_name", drm_root, card_name);
+    if (read_attribute(path, value, sizeof(value)) && value[0]) {
+        copy_field(card->name, value, strlen(value));
+        return;
+    }
+    const char *vendor_name = !strcmp(card->vendor, "0x1002") ? "AMD"
+        : !strcmp(card->vendor, "0x10de") ? "NVIDIA"
+        : !strcmp(card->vendor, "0x8086") ? "Intel" : "Unknown";
+    snprintf(path, sizeof(path), "%s/%s/device/device", drm_root, card_name);
+    if (!read_attribute(path, value, sizeof(value)))
+        strcpy(value, "?");
+    snprintf(card->name, BUFFERSIZE, "%s GPU %.16s (%.32s)", vendor_name, value, card_name);
+}
+
+// Lists the cardN entries of a DRM class directory once, in card order.
+// Connector entries (card0-DP-1) and render nodes are skipped.
+void enumerate_drm_cards(const char *drm_root) {
+    DIR *dir = opendir(drm_root);
+    if (!dir)
+        return;
+    drm_enumerated = TRUE;
+
+    long indices[DRM_MAX_CARDS];
+    struct dirent *entry;
+    while ((entry = readdir(dir)) && drm_card_count < DRM_MAX_CARDS) {
+        if (strncmp(entry->d_name, "card", 4) || !entry->d_name[4])
+            continue;
+        char *end;
+        long index = strtol(entry->d_name + 4, &end, 10);
+        if (*end)
+            continue;
+        size_t i = drm_card_count++;
+        while (i > 0 && indices[i - 1] > index) {
+            indices[i] = indices[i - 1];
+            memcpy(&drm_cards[i], &drm_cards[i - 1], sizeof(drm_card));
+            i--;
+        }
+        indices[i] = index;
+        setup_drm_card(&drm_cards[i], drm_root, entry->d_name);
+    }
+    closedir(dir);
+
+    // Sources point into their own card's paths, fix them up after the moves
+    for (size_t i = 0; i < drm_card_count; i++) {
+        drm_cards[i].vram_used.path = drm_cards[i].paths[0];
+        drm_cards[i].vram_total.path = drm_cards[i].paths[1];
+        drm_cards[i].busy_percent.path = drm_cards[i].paths[2];
+    }
+}
+
+// A tool is only needed when sysfs could not be listed or one of its cards
+// does not expose the attributes
+BOOL gpu_session_needed(const gpu_session *session) {
+    if (!drm_enumerated)
+        return TRUE;
+    for (size_t i = 0; i < drm_card_count; i++)
+        if (!drm_cards[i].has_data && !strcmp(drm_cards[i].vendor, session->vendor))
+            return TRUE;
+    return FALSE;
+}
+
+void fetch_drm_card(drm_card *card, gpu_stats *gpu) {
+    proc_source *used = &card->vram_used,
+                *total = &card->vram_total,
+                *busy = &card->busy_percent;
+    strncpy(gpu->name, card->name, BUFFERSIZE);
+    if (read_proc_source(used) && read_proc_source(total)) {
+        gpu->vram_used_mib = strtoull(used->buffer, NULL, 10) / 1024 / 1024;
+        gpu->vram_total_mib = strtoull(total->buffer, NULL, 10) / 1024 / 1024;
+    }
+    if (read_proc_source(busy))
+        gpu->activity = atoi(busy->buffer);
+}
+
+// Sample period handed to the tools, follows the gpus collector interval
+static char gpu_sample_period[24] = "2000"; // Fits any long
+static char *const nvidia_smi_argv[] = {
+    "nvidia-smi", "--query-gpu=index,name,memory.used,memory.total,utilization.gpu",
+    "--format=csv,noheader,nounits", "-lms", gpu_sample_period, NULL
+};
+static char *const amdgpu_top_argv[] = { "amdgpu_top", "-J", "-s", gpu_sample_period, NULL };
+
+static gpu_session gpu_sessions[] = {
+    { .argv = amdgpu_top_argv, .vendor = "0x1002", .stream = STREAM_SESSION,
+      .record_end = amdgpu_top_record_end, .parse_record = parse_amdgpu_top_record },
+    { .argv = nvidia_smi_argv, .vendor = "0x10de", .stream = STREAM_SESSION,
+      .record_end = nvidia_smi_record_end, .parse_record = parse_nvidia_smi_record },
+};
+#define GPU_SESSION_COUNT (sizeof(gpu_sessions) / sizeof(*gpu_sessions))
+
+// Cards with sysfs attributes are read directly, the tools are only started
+// (when allowed) for the cards that need them
+void start_gpu_sessions(long sample_period_ms, BOOL tools) {
+    enumerate_drm_cards("/sys/class/drm");
+    if (!tools)
+        return;
+    snprintf(gpu_sample_period, sizeof(gpu_sample_period), "%ld", sample_period_ms > 0 ? sample_period_ms : 2000);
+    for (size_t i = 0; i < GPU_SESSION_COUNT; i++)
+        if (gpu_session_needed(&gpu_sessions[i]))
+            start_stream_session(&gpu_sessions[i].stream, gpu_sessions[i].argv);
+}
+
+void stop_gpu_sessions() {
+    for (size_t i = 0; i < GPU_SESSION_COUNT; i++)
+        stop_stream_session(&gpu_sessions[i].stream);
+}
+
+// Parses every complete record in `data`, returns how many bytes they took
+size_t parse_gpu_records(gpu_session *session, char *data, size_t length) {
+    size_t offset = 0, end;
+    while (offset < length && (end = session->record_end(data + offset, length - offset))) {
+        char *record = data + offset;
+        char saved = record[end - 1];
+        record[end - 1] = '\0';
+        session->parse_record(session, record);
+        record[end - 1] = saved;
+        session->stream.record_count++;
+        if (session->gpu_count)
+            session->produced = TRUE;
+        offset += end;
+    }
+    return offset;
+}
+
+// Parses every complete record the tool has written since the last refresh,
+// a partial record is kept for the next one
+void refresh_gpu_session(gpu_session *session) {
+    stream_session *stream = &session->stream;
+    if (stream->failed)
+        return;
+    if (stream->fd < 0) {
+        // Only restart tools that worked before, one that fails to start or
+        // exits without output (e.g. no such GPU) is not retried
+        if (!session->produced || !start_stream_session(stream, session->argv))
+            return;
+        session->produced = FALSE;
+    }
+    read_stream_session(stream);
+    consume_stream_session(stream, parse_gpu_records(session, stream->pending.data, stream->pending.length));
+    if (stream->fd < 0) {
+        session->gpu_count = 0;
+        if (!session->produced)
+            stream->failed = TRUE;
+    }
+}
+
+// Blocks until every running tool has reported its GPUs or exited, or until
+// the timeout. Only --once needs this, the animation just picks the records
+// up on a later refresh.
+void wait_gpu_sessions(int timeout_ms) {
+    long long deadline = monotonic_ns() + timeout_ms * 1000000LL;
+    while (1) {
+        struct pollfd pfds[GPU_SESSION_COUNT];
+        gpu_session *waiting[GPU_SESSION_COUNT];
+        nfds_t count = 0;
+        for (size_t i = 0; i < GPU_SESSION_COUNT; i++) {
+            if (gpu_sessions[i].stream.fd < 0 || gpu_sessions[i].produced)
+                continue;
+            waiting[count] = &gpu_sessions[i];
+            pfds[count++] = (struct pollfd){ .fd = gpu_sessions[i].stream.fd, .events = POLLIN };
+        }
+        long long left = (deadline - monotonic_ns()) / 1000000;
+        if (!count || left <= 0)
+            return;
+        PROFILE_COUNT(poll_calls);
+        if (poll(pfds, count, left) <= 0)
+            return;
+        for (nfds_t i = 0; i < count; i++)
+            if (pfds[i].revents)
+                refresh_gpu_session(waiting[i]);
+    }
+}
+
+// A tool started for one card lists every card of its vendor, the ones
+// already read from sysfs are skipped
+BOOL drm_card_covers(const char *bus_id) {
+    if (!bus_id[0])
+        return FALSE;
+    for (size_t i = 0; i < drm_card_count; i++)
+        if (drm_cards[i].has_data && !strcasecmp(drm_cards[i].bus_id, bus_id))
+            return TRUE;
+    return FALSE;
+}
+
+void add_session_gpus(const gpu_session *session, stats_snapshot *snapshot) {
+    for (size_t j = 0; j < session->gpu_count; j++)
+        if (!drm_card_covers(session->bus_ids[j]))
+            *add_gpu(snapshot) = session->gpus[j];
+}
+
+void fetch_gpu_stats_multiple(stats_snapshot *snapshot) {
+    NULL_RETURN(snapshot);
+    snapshot->gpu_count = 0;
+
+    for (size_t i = 0; i < drm_card_count; i++)
+        if (drm_cards[i].has_data)
+            fetch_drm_card(&drm_cards[i], add_gpu(snapshot));
+    for (size_t i = 0; i < GPU_SESSION_COUNT; i++) {
+        refresh_gpu_session(&gpu_sessions[i]);
+        add_session_gpus(&gpu_sessions[i], snapshot);
+    }
+}
+
+// Keys picked out of /proc/meminfo, see parse_meminfo()
+static const struct {
+    const char *key;
+    size_t length;
+    size_t offset;
+    unsigned int bit;
+} meminfo_keys[] = {
+#define MEMINFO_KEY(name, field, flag) { name, sizeof(name) - 1, offsetof(meminfo_snapshot, field), flag }
+    MEMINFO_KEY("MemTotal", mem_total_kB, MEMINFO_MEM_TOTAL),
+    MEMINFO_KEY("MemFree", mem_free_kB, MEMINFO_MEM_FREE),
+    MEMINFO_KEY("MemAvailable", mem_available_kB, MEMINFO_MEM_AVAILABLE),
+    MEMINFO_KEY("Buffers", buffers_kB, MEMINFO_BUFFERS),
+    MEMINFO_KEY("Cached", cached_kB, MEMINFO_CACHED),
+    MEMINFO_KEY("SwapTotal", swap_total_kB, MEMINFO_SWAP_TOTAL),
+    MEMINFO_KEY("SwapFree", swap_free_kB, MEMINFO_SWAP_FREE),
+    MEMINFO_KEY("Dirty", dirty_kB, MEMINFO_DIRTY),
+    MEMINFO_KEY("Shmem", shmem_kB, MEMINFO_SHMEM),
+    MEMINFO_KEY("HugePages_Total", hugepages_total, MEMINFO_HUGEPAGES_TOTAL),
+    MEMINFO_KEY("HugePages_Free", hugepages_free, MEMINFO_HUGEPAGES_FREE),
+    MEMINFO_KEY("Hugepagesize", hugepage_size_kB, MEMINFO_HUGEPAGE_SIZE),
+#undef MEMINFO_KEY
+};
+
+// Single pass over a /proc/meminfo buffer. Each line's key is dispatched on its
+// length and first character before a memcmp, the value is parsed by hand.
+void parse_meminfo(const char *buffer, meminfo_snapshot *meminfo) {
+    memset(meminfo, 0, sizeof(*meminfo));
+    const size_t key_count = sizeof(meminfo_keys) / sizeof(*meminfo_keys);
+
+    const char *line = buffer;
+    while (*line) {
+        const char *colon = strchr(line, ':');
+        if (!colon)
             break;
-        sscanf(buffer, "MemTotal: %zd kB", &total_kB);
-        sscanf(buffer, "MemAvailable: %zd kB", &used_kB);
+        const size_t length = colon - line;
+
+        for (size_t i = 0; i < key_count; i++) {
+            if (meminfo_keys[i].length != length || meminfo_keys[i].key[0] != line[0] ||
+                memcmp(meminfo_keys[i].key, line, length))
+                continue;
+            const char *value = colon + 1;
+            while (*value == ' ')
+                value++;
+            size_t number = 0;
+            while (*value >= '0' && *value <= '9')
+                number = number * 10 + (*value++ - '0');
+            *(size_t *)((char *)meminfo + meminfo_keys[i].offset) = number;
+            meminfo->present |= meminfo_keys[i].bit;
+            break;
+        }
+
+        line = strchr(colon, '\n');
+        if (!line)
+            break;
+        line++;
     }
+}
+
+void fetch_meminfo(meminfo_snapshot *meminfo) {
+    NULL_RETURN(meminfo);
+    memset(meminfo, 0, sizeof(*meminfo));
 
-    if (total_kB && used_kB) {
-        used_kB = total_kB - used_kB;
+    if (read_proc_source(&meminfo_source))
+        parse_meminfo(meminfo_source.buffer, meminfo);
+}
+
+void format_ram_usage(char *ram_usage, const meminfo_snapshot *meminfo) {
+    NULL_RETURN(ram_usage);
+    strncpy(ram_usage, DEFAULTSTRING, BUFFERSIZE);
+
+    const unsigned int needed = MEMINFO_MEM_TOTAL | MEMINFO_MEM_AVAILABLE;
+    if ((meminfo->present & needed) == needed && meminfo->mem_total_kB) {
+        size_t total_kB = meminfo->mem_total_kB;
+        size_t used_kB = total_kB - meminfo->mem_available_kB;
         snprintf(ram_usage, BUFFERSIZE,
             "%.2fGB / %.2fGB (%.0f%%)",
             (double)used_kB / 1024 / 1024,
@@ -427,328 +1155,1758 @@ void fetch_ram_usage(char *ram_usage) {
             (double)used_kB / total_kB * 100
         );
     }
-
-    fclose(f);
 }
 
-void fetch_swap_usage(char *swap_usage) {
+void format_swap_usage(char *swap_usage, const meminfo_snapshot *meminfo) {
     NULL_RETURN(swap_usage);
     strncpy(swap_usage, DEFAULTSTRING, BUFFERSIZE);
 
-    FILE *f = fopen("/proc/meminfo", "r");
-    if (!f)
-        return;
-
-    char buffer[BUFFERSIZE] = { 0 };
-    size_t total_kB = 0, used_kB = 0;
-    while (fgets(buffer, BUFFERSIZE, f) != NULL) {
-        if (total_kB && used_kB)
-            break;
-        sscanf(buffer, "SwapTotal: %zd kB", &total_kB);
-        sscanf(buffer, "SwapFree: %zd kB", &used_kB);
-    }
-
-    if (total_kB && used_kB) {
-        used_kB = total_kB - used_kB;
+    const unsigned int needed = MEMINFO_SWAP_TOTAL | MEMINFO_SWAP_FREE;
+    if ((meminfo->present & needed) == needed && meminfo->swap_total_kB) {
+        size_t total_kB = meminfo->swap_total_kB;
+        size_t used_kB = total_kB - meminfo->swap_free_kB;
         snprintf(swap_usage, BUFFERSIZE,
-            "%.2fGB / %.2fGB (%.0f%%)  ",
+            "%.2fGB / %.2fGB (%.0f%%)",
             (double)used_kB / 1024 / 1024,
             (double)total_kB / 1024 / 1024,
             (double)used_kB * 100 / total_kB
         );
     }
+}
 
-    fclose(f);
+static disk_pool disks = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+void *handle_disk_worker(void *data) {
+    disk_pool *pool = data;
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        while (!pool->head)
+            pthread_cond_wait(&pool->work, &pool->mutex);
+        disk_sample *sample = pool->head;
+        pool->head = sample->next;
+        if (!pool->head)
+            pool->tail = NULL;
+        pthread_mutex_unlock(&pool->mutex);
+
+        // The mount point of a sample never changes, so it is read unlocked
+        struct statvfs data;
+        PROFILE_COUNT(statvfs_calls);
+        BOOL ok = !statvfs(sample->mount_point, &data);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (sample->removed) {
+            free(sample);
+            continue;
+        }
+        if (ok) {
+            sample->total_bytes = data.f_frsize * data.f_blocks;
+            sample->used_bytes = sample->total_bytes - data.f_frsize * data.f_bfree;
+            sample->sampled = TRUE;
+        }
+        sample->in_flight = FALSE;
+        pthread_cond_broadcast(&pool->done);
+    }
+    return NULL;
 }
 
-void fetch_disk_usage(char disk_usage[2][256], const char* vfspath, const char* devpath) {
-    NULL_RETURN(disk_usage);
+// Called with the mutex held
+disk_sample *find_disk_sample(disk_pool *pool, const char *mount_point) {
+    for (size_t i = 0; i < pool->sample_count; i++)
+        if (!strcmp(pool->samples[i]->mount_point, mount_point))
+            return pool->samples[i];
+    if (pool->sample_count == pool->sample_capacity) {
+        pool->sample_capacity = pool->sample_capacity ? pool->sample_capacity * 2 : 16;
+        pool->samples = realloc(pool->samples, pool->sample_capacity * sizeof(disk_sample *));
+    }
+    disk_sample *sample = calloc(1, sizeof(disk_sample));
+    copy_field(sample->mount_point, mount_point, strlen(mount_point));
+    pool->samples[pool->sample_count++] = sample;
+    return sample;
+}
 
-    struct statvfs data;
-    if (!statvfs(vfspath, &data)) {
-        size_t total_bytes = data.f_frsize * data.f_blocks;
-        size_t used_bytes = total_bytes - data.f_frsize * data.f_bfree;
-        snprintf(disk_usage[0], BUFFERSIZE,
-            "%s at %s",
-            devpath,
-            vfspath
-        );
-        snprintf(disk_usage[1], BUFFERSIZE,
-            "%.1fGB / %.1fGB (%.0f%%)  ",
-            (double)used_bytes / 1024 / 1024 / 1024,
-            (double)total_bytes / 1024 / 1024 / 1024,
-            (double)used_bytes * 100 / total_bytes
-        );
+// Queues a statvfs() of every mount and waits for them until the deadline.
+// Mounts that are still being sampled then are marked stale and keep their
+// last value, a mount whose earlier sample has not returned yet is not
+// queued again.
+void sample_disks(disk_pool *pool, const mount_table *table, stats_snapshot *snapshot) {
+    pthread_mutex_lock(&pool->mutex);
+    if (!pool->started) {
+        pool->started = TRUE;
+        for (int i = 0; i < DISK_WORKERS; i++) {
+            pthread_t worker;
+            if (!pthread_create(&worker, NULL, handle_disk_worker, pool))
+                pthread_detach(worker);
+        }
+    }
+
+    disk_sample *wanted[table->count ? table->count : 1];
+    pool->generation++;
+    for (size_t i = 0; i < table->count; i++) {
+        disk_sample *sample = wanted[i] = find_disk_sample(pool, table->entries[i].mount_point);
+        sample->generation = pool->generation;
+        if (sample->in_flight)
+            continue;
+        sample->in_flight = TRUE;
+        sample->next = NULL;
+        if (pool->tail)
+            pool->tail->next = sample;
+        else
+            pool->head = sample;
+        pool->tail = sample;
+    }
+    pthread_cond_broadcast(&pool->work);
+
+    // Samples of mounts that are gone are dropped, or left to their worker
+    // to free while one is still waiting on them
+    size_t kept = 0;
+    for (size_t i = 0; i < pool->sample_count; i++) {
+        disk_sample *sample = pool->samples[i];
+        if (sample->generation == pool->generation)
+            pool->samples[kept++] = sample;
+        else if (sample->in_flight)
+            sample->removed = TRUE;
+        else
+            free(sample);
     }
+    pool->sample_count = kept;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += DISK_SAMPLE_DEADLINE_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    for (size_t i = 0; i < table->count; i++)
+        while (wanted[i]->in_flight)
+            if (pthread_cond_timedwait(&pool->done, &pool->mutex, &deadline))
+                goto timed_out;
+timed_out:
+
+    for (size_t i = 0; i < table->count; i++) {
+        disk_stats *disk = add_disk(snapshot);
+        copy_field(disk->device, table->entries[i].device, strlen(table->entries[i].device));
+        copy_field(disk->mount_point, table->entries[i].mount_point, strlen(table->entries[i].mount_point));
+        // statvfs() is given the decoded path, a \012 or \011 in it is shown as '?'
+        strip_control_bytes(disk->device, BUFFERSIZE);
+        strip_control_bytes(disk->mount_point, BUFFERSIZE);
+        disk->used_bytes = wanted[i]->used_bytes;
+        disk->total_bytes = wanted[i]->sampled ? wanted[i]->total_bytes : 0;
+        disk->stale = wanted[i]->in_flight;
+        if (disk->stale)
+            pool->stale_count++;
+    }
+    pthread_mutex_unlock(&pool->mutex);
 }
 
-void fetch_disk_usage_multiple(char disk_usage[BUFFERSIZE][2][BUFFERSIZE], size_t* mount_count)
-{
-    NULL_RETURN(mount_count);
-    size_t mc = 0;
-    *mount_count = mc;
-    NULL_RETURN(disk_usage);
-    for(int i=0;i<BUFFERSIZE;i++)
-    {
-        strncpy(disk_usage[i][0], DEFAULTSTRING, BUFFERSIZE);
-        strncpy(disk_usage[i][1], DEFAULTSTRING, BUFFERSIZE);
+// Copies one space separated field of a mounts line, undoing the octal
+// escapes (\040 for a space, ...) the kernel writes. Returns the field end.
+// The field may then hold a newline or a tab, sample_disks() replaces them
+// in what is displayed.
+const char *copy_mount_field(char *dest, const char *src) {
+    size_t length = 0;
+    while (*src && *src != ' ' && *src != '\n') {
+        char c = *src++;
+        if (c == '\\' && src[0] >= '0' && src[0] <= '3' && src[1] >= '0' && src[1] <= '7'
+            && src[2] >= '0' && src[2] <= '7') {
+            c = (src[0] - '0') * 64 + (src[1] - '0') * 8 + (src[2] - '0');
+            src += 3;
+        }
+        if (length < BUFFERSIZE - 1)
+            dest[length++] = c;
     }
+    dest[length] = '\0';
+    return src;
+}
 
-    FILE *f = fopen("/proc/mounts", "r");
+// Block devices (sd, vd, nvme, hd, etc.) mounted on real filesystem mount
+// points, loop devices, ram disks and /proc, /sys, /dev, ... are skipped
+BOOL is_listed_mount(const mount_entry *entry) {
+    const char *device = entry->device, *mount = entry->mount_point;
+    if (strncmp(device, "/dev/", 5) != 0 ||
+        strncmp(device, "/dev/loop", 9) == 0 ||
+        strncmp(device, "/dev/ram", 8) == 0 ||
+        strncmp(device, "/dev/dm-", 8) == 0 ||
+        strncmp(device, "/dev/mapper/", 12) == 0)
+        return FALSE;
+    return mount[0] == '/' &&
+        strncmp(mount, "/proc", 5) != 0 &&
+        strncmp(mount, "/sys", 4) != 0 &&
+        strncmp(mount, "/dev", 4) != 0 &&
+        strncmp(mount, "/run", 4) != 0 &&
+        strncmp(mount, "/tmp", 4) != 0;
+}
 
-    dynamic_string mount_list = new_dynamic_string("");
+// Parses a /proc/mounts buffer line by line into the filtered table
+void parse_mount_table(const char *buffer, mount_table *table) {
+    table->count = 0;
+    table->parse_count++;
+    for (const char *line = buffer; *line; ) {
+        if (table->count == table->capacity) {
+            table->capacity = table->capacity ? table->capacity * 2 : 16;
+            table->entries = realloc(table->entries, table->capacity * sizeof(mount_entry));
+        }
+        mount_entry *entry = &table->entries[table->count];
+        const char *it = copy_mount_field(entry->device, line);
+        if (*it == ' ')
+            copy_mount_field(entry->mount_point, it + 1);
+        else
+            entry->mount_point[0] = '\0';
+        if (is_listed_mount(entry))
+            table->count++;
+
+        const char *next = strchr(line, '\n');
+        if (!next)
+            break;
+        line = next + 1;
+    }
+}
 
+// The mount table of /proc/self/mounts signals POLLPRI|POLLERR once after
+// each change, until then the parsed table is reused as is
+BOOL mounts_changed(const proc_source *source) {
+    if (source->fd < 0)
+        return TRUE;
+    struct pollfd pfd = { .fd = source->fd, .events = POLLPRI };
+    PROFILE_COUNT(poll_calls);
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLPRI | POLLERR));
+}
 
+static mount_table mounts = { 0 };
 
+void fetch_disk_usage_multiple(stats_snapshot *snapshot)
+{
+    NULL_RETURN(snapshot);
+    snapshot->disk_count = 0;
 
-    if (f != NULL) {
-        char buffer[BUFFERSIZE+1] = {0};
-        while(fgets(buffer,BUFFERSIZE,f))
-        {
-            append_dynamic_string(&mount_list,buffer);
+    if (mounts_changed(&mounts_source) && read_proc_source(&mounts_source))
+        parse_mount_table(mounts_source.buffer, &mounts);
+    sample_disks(&disks, &mounts, snapshot);
+}
+
+struct linux_dirent64 {
+    __uint64_t d_ino;
+    __int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Counts the pid directories of a procfs-like tree with raw getdents64 calls,
+// nothing is opened or stat()ed per entry. The directory fd is kept open and
+// rewound on later calls.
+long count_processes(int *proc_fd, const char *proc_root) {
+    if (*proc_fd < 0) {
+        *proc_fd = open(proc_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (*proc_fd < 0)
+            return -1;
+    } else if (lseek(*proc_fd, 0, SEEK_SET) < 0) {
+        return -1;
+    }
+
+    char buffer[32768];
+    long count = 0, n;
+    while (PROFILE_COUNT(getdents_calls), (n = syscall(SYS_getdents64, *proc_fd, buffer, sizeof(buffer))) > 0) {
+        for (long pos = 0; pos < n;) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(buffer + pos);
+            if (entry->d_name[0] >= '1' && entry->d_name[0] <= '9')
+                count++;
+            pos += entry->d_reclen;
         }
+    }
+    return n < 0 ? -1 : count;
+}
 
-        // Look for all block devices (sd, vd, nvme, hd, etc.)
-        char* search_pos = mount_list.str;
-        while ((search_pos = strstr(search_pos, "\n/dev/")) != NULL) {
-            search_pos++; // Skip the newline
+void fetch_process_count(long *process_count) {
+    NULL_RETURN(process_count);
 
-            // Check if this is a block device we want to include
-            // Skip loop devices, ram disks, and other virtual devices
-            if (strncmp(search_pos, "/dev/loop", 9) == 0 ||
-                strncmp(search_pos, "/dev/ram", 8) == 0 ||
-                strncmp(search_pos, "/dev/dm-", 8) == 0 ||
-                strncmp(search_pos, "/dev/mapper/", 12) == 0) {
-                search_pos++;
-                continue;
-            }
+    static int proc_fd = -1;
+    *process_count = count_processes(&proc_fd, "/proc");
+}
 
-            // Extract device name
-            char dev[BUFFERSIZE] = {0};
-            for(int i=0;(i<BUFFERSIZE)&& !(search_pos[i]==' '&&search_pos[i-1]!='\\');i++)
-            {
-                dev[i] = search_pos[i];
-            }
+void fetch_uptime(long *uptime) {
+    NULL_RETURN(uptime);
+    *uptime = -1;
 
-            // Extract mount point
-            char mount[BUFFERSIZE] = {0};
-            char* mount_loc = strstr(search_pos, " /");
-            if (mount_loc != NULL) {
-                mount_loc++;
-                for(int i=0;(i<BUFFERSIZE)&&(mount_loc[i]!=' ');i++)
-                {
-                    mount[i] = mount_loc[i];
-                }
+    struct sysinfo data;
+    if (!sysinfo(&data))
+        *uptime = data.uptime;
+}
 
-                // Only include real filesystem mount points (skip /proc, /sys, /dev, etc.)
-                if (strncmp(mount, "/proc", 5) != 0 &&
-                    strncmp(mount, "/sys", 4) != 0 &&
-                    strncmp(mount, "/dev", 4) != 0 &&
-                    strncmp(mount, "/run", 4) != 0 &&
-                    strncmp(mount, "/tmp", 4) != 0) {
-                    fetch_disk_usage(disk_usage[mc], mount, dev);
-                    mc++;
-                }
-            }
-            search_pos++;
+void fetch_battery_charge(int *battery_charge) {
+    NULL_RETURN(battery_charge);
+    *battery_charge = -1;
+
+    if (read_proc_source(&battery_source))
+        *battery_charge = atoi(battery_source.buffer);
+}
+
+void collect_datetime(stats_snapshot *snapshot) { fetch_datetime(&snapshot->datetime); }
+void collect_cpu_usage(stats_snapshot *snapshot) { fetch_cpu_usage(&cpu_table, snapshot); }
+void collect_meminfo(stats_snapshot *snapshot) { fetch_meminfo(&snapshot->meminfo); }
+void collect_process_count(stats_snapshot *snapshot) { fetch_process_count(&snapshot->process_count); }
+void collect_uptime(stats_snapshot *snapshot) { fetch_uptime(&snapshot->uptime); }
+void collect_battery_charge(stats_snapshot *snapshot) { fetch_battery_charge(&snapshot->battery_charge); }
+
+// Default refresh periods, the clock and uptime tick every second so they are
+// refreshed well within one. Override with --interval name=ms.
+static collector collectors[] = {
+    { .name = "datetime",  .collect = collect_datetime,          .fields = SNAPSHOT_DATETIME,  .cost = COLLECTOR_CHEAP,     .interval_ms = 250 },
+    { .name = "uptime",    .collect = collect_uptime,            .fields = SNAPSHOT_UPTIME,    .cost = COLLECTOR_CHEAP,     .interval_ms = 250 },
+    { .name = "cpu",       .collect = collect_cpu_usage,         .fields = SNAPSHOT_CPU,       .cost = COLLECTOR_CHEAP,     .interval_ms = 500 },
+    { .name = "memory",    .collect = collect_meminfo,           .fields = SNAPSHOT_MEMORY,    .cost = COLLECTOR_CHEAP,     .interval_ms = 500 },
+    { .name = "processes", .collect = collect_process_count,     .fields = SNAPSHOT_PROCESSES, .cost = COLLECTOR_CHEAP,     .interval_ms = 1000 },
+    { .name = "battery",   .collect = collect_battery_charge,    .fields = SNAPSHOT_BATTERY,   .cost = COLLECTOR_CHEAP,     .interval_ms = 30000 },
+    { .name = "gpus",      .collect = fetch_gpu_stats_multiple,  .fields = SNAPSHOT_GPUS,      .cost = COLLECTOR_EXPENSIVE, .interval_ms = 2000 },
+    { .name = "disks",     .collect = fetch_disk_usage_multiple, .fields = SNAPSHOT_DISKS,     .cost = COLLECTOR_EXPENSIVE, .interval_ms = 5000 },
+};
+#define COLLECTOR_COUNT (sizeof(collectors) / sizeof(*collectors))
+static deadline_heap collector_queue = { 0 };
+
+collector *find_collector(const char *name, size_t length) {
+    for (size_t i = 0; i < COLLECTOR_COUNT; i++)
+        if (strlen(collectors[i].name) == length && !strncmp(collectors[i].name, name, length))
+            return &collectors[i];
+    return NULL;
+}
+
+void run_collector(collector *c, stats_snapshot *snapshot) {
+    PROFILE_BEGIN(start);
+    c->collect(snapshot);
+    PROFILE_END(&c->latency, start);
+    c->run_count++;
+}
+
+// Parses a "name=ms" --interval argument
+BOOL parse_collector_interval(const char *argument) {
+    const char *separator = strchr(argument, '=');
+    if (!separator)
+        return FALSE;
+    collector *c = find_collector(argument, separator - argument);
+    char *end;
+    long interval_ms = strtol(separator + 1, &end, 10);
+    if (!c || end == separator + 1 || *end || interval_ms < 0)
+        return FALSE;
+    c->interval_ms = interval_ms;
+    return TRUE;
+}
+
+// Copies the ready fields of a snapshot, the destination keeps and grows its
+// own tables. Fields that are not ready may still be written by a startup job.
+void copy_snapshot(stats_snapshot *dest, const stats_snapshot *src) {
+    unsigned ready = src->ready;
+    if (ready & SNAPSHOT_DATETIME)
+        dest->datetime = src->datetime;
+    if (ready & SNAPSHOT_UPTIME)
+        dest->uptime = src->uptime;
+    if (ready & SNAPSHOT_CPU) {
+        dest->cpu_usage = src->cpu_usage;
+        if (dest->core_capacity < src->core_count) {
+            dest->core_capacity = src->core_capacity;
+            dest->core_usage = realloc(dest->core_usage, dest->core_capacity * sizeof(float));
+        }
+        if (src->core_count)
+            memcpy(dest->core_usage, src->core_usage, src->core_count * sizeof(float));
+        dest->core_count = src->core_count;
+    }
+    if (ready & SNAPSHOT_MEMORY)
+        dest->meminfo = src->meminfo;
+    if (ready & SNAPSHOT_PROCESSES)
+        dest->process_count = src->process_count;
+    if (ready & SNAPSHOT_BATTERY)
+        dest->battery_charge = src->battery_charge;
+    if (ready & SNAPSHOT_GPUS) {
+        if (dest->gpu_capacity < src->gpu_count) {
+            dest->gpu_capacity = src->gpu_capacity;
+            dest->gpus = realloc(dest->gpus, dest->gpu_capacity * sizeof(gpu_stats));
+        }
+        if (src->gpu_count)
+            memcpy(dest->gpus, src->gpus, src->gpu_count * sizeof(gpu_stats));
+        dest->gpu_count = src->gpu_count;
+    }
+    if (ready & SNAPSHOT_DISKS) {
+        if (dest->disk_capacity < src->disk_count) {
+            dest->disk_capacity = src->disk_capacity;
+            dest->disks = realloc(dest->disks, dest->disk_capacity * sizeof(disk_stats));
         }
+        if (src->disk_count)
+            memcpy(dest->disks, src->disks, src->disk_count * sizeof(disk_stats));
+        dest->disk_count = src->disk_count;
     }
+    dest->ready = ready;
+}
 
+// Values of collectors that have not run (or are disabled) read as unknown
+void init_snapshot(stats_snapshot *snapshot) {
+    snapshot->datetime = -1;
+    snapshot->cpu_usage = -1;
+    snapshot->process_count = -1;
+    snapshot->uptime = -1;
+    snapshot->battery_charge = -1;
+}
 
-    free_dynamic_string(&mount_list);
-    fclose(f);
-    *mount_count = mc;
+static startup_pool startup = { 0 };
+
+void run_startup_job(system_stats *stats, startup_job *job) {
+    collector *c = job->collector;
+    if (!c) {
+        job->fetch(job->buffer);
+        return;
+    }
+    // --once only starts the GPU tools when asked to, sysfs cards are always read
+    if (c->collect == fetch_gpu_stats_multiple) {
+        BOOL tools = !stats->flags.once || stats->flags.gpu_tools;
+        start_gpu_sessions(c->interval_ms, tools);
+        if (stats->flags.once && tools)
+            wait_gpu_sessions(GPU_SESSION_WAIT_MS);
+    }
+    run_collector(c, &stats->working);
 }
 
-void fetch_process_count(char *process_count) {
-    NULL_RETURN(process_count);
-    strncpy(process_count, DEFAULTSTRING, BUFFERSIZE);
-    char buffer[BUFFERSIZE] = { 0 };
+void *handle_startup_jobs(void *data) {
+    startup_pool *pool = data;
+    size_t i;
+    while ((i = atomic_fetch_add(&pool->next_job, 1)) < pool->job_count) {
+        startup_job *job = &pool->jobs[i];
+        run_startup_job(pool->stats, job);
+        collector_cost cost = job->collector ? job->collector->cost : COLLECTOR_CHEAP;
+        if (job->collector)
+            atomic_fetch_or_explicit(&pool->done, job->collector->fields, memory_order_release);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (!--pool->pending[cost])
+            pool->finished_ns[cost] = monotonic_ns() - pool->start_ns;
+        pthread_cond_broadcast(&pool->finished);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    return NULL;
+}
 
-    FILE *f = popen("ps -aux | wc -l", "r");
-    if (fgets(buffer, BUFFERSIZE, f) != NULL) {
-        strncpy(process_count, buffer, BUFFERSIZE);
+void queue_startup_collectors(startup_pool *pool, collector_cost cost) {
+    for (size_t i = 0; i < COLLECTOR_COUNT; i++) {
+        if (!collectors[i].interval_ms || collectors[i].cost != cost)
+            continue;
+        pool->jobs[pool->job_count++] = (startup_job){ .collector = &collectors[i] };
+        pool->pending[cost]++;
     }
-    pclose(f);
 }
 
-void fetch_uptime(char *uptime) {
-    NULL_RETURN(uptime);
-    strncpy(uptime, DEFAULTSTRING, BUFFERSIZE);
+// Every startup job writes only its own fields, so they all run at once.
+// Clients of a daemon only fetch the identity strings, and a client whose
+// daemon went away starts the pool again for the collectors alone.
+void start_startup_jobs(startup_pool *pool, system_stats *stats, BOOL identity, BOOL collectors) {
+    if (pool->stats) {
+        pthread_mutex_destroy(&pool->mutex);
+        pthread_cond_destroy(&pool->finished);
+        memset(pool, 0, sizeof(*pool));
+    }
+    pool->stats = stats;
+    pool->start_ns = monotonic_ns();
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->finished, &attributes);
+    pthread_condattr_destroy(&attributes);
+
+    if (collectors)
+        queue_startup_collectors(pool, COLLECTOR_EXPENSIVE);
+    const startup_job identity_jobs[] = {
+        { .fetch = fetch_user_name,      .buffer = stats->user_name },
+        { .fetch = fetch_host_name,      .buffer = stats->host_name },
+        { .fetch = fetch_os_name,        .buffer = stats->os_name },
+        { .fetch = fetch_kernel_version, .buffer = stats->kernel_version },
+        { .fetch = fetch_desktop_name,   .buffer = stats->desktop_name },
+        { .fetch = fetch_shell_name,     .buffer = stats->shell_name },
+        { .fetch = fetch_terminal_name,  .buffer = stats->terminal_name },
+        { .fetch = fetch_cpu_name,       .buffer = stats->cpu_name },
+    };
+    if (identity) {
+        for (size_t i = 0; i < sizeof(identity_jobs) / sizeof(*identity_jobs); i++)
+            pool->jobs[pool->job_count++] = identity_jobs[i];
+        pool->pending[COLLECTOR_CHEAP] += sizeof(identity_jobs) / sizeof(*identity_jobs);
+    }
+    if (collectors)
+        queue_startup_collectors(pool, COLLECTOR_CHEAP);
+
+    for (int i = 0; i < STARTUP_THREADS; i++)
+        if (!pthread_create(&pool->threads[pool->thread_count], NULL, handle_startup_jobs, pool))
+            pool->thread_count++;
+    if (!pool->thread_count)
+        handle_startup_jobs(pool);
+}
 
-    struct sysinfo data;
-    if (!sysinfo(&data)) {
-        int d = data.uptime / 86400,
-			h = (data.uptime / 3600) % 24,
-            m = data.uptime % 3600 / 60,
-            s = data.uptime % 60;
-        snprintf(uptime, BUFFERSIZE, "%02d:%02d:%02d:%02d",d, h, m, s);
+// Blocks until every job of `cost` or cheaper has finished
+void wait_startup_jobs(startup_pool *pool, collector_cost cost) {
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->pending[COLLECTOR_CHEAP] || (cost == COLLECTOR_EXPENSIVE && pool->pending[COLLECTOR_EXPENSIVE]))
+        pthread_cond_wait(&pool->finished, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Sleeps until a collector whose fields are not in `seen` finishes its
+// startup run, or until `deadline_ns`
+void wait_startup_collectors(startup_pool *pool, unsigned seen, long long deadline_ns) {
+    struct timespec ts = { deadline_ns / 1000000000LL, deadline_ns % 1000000000LL };
+    pthread_mutex_lock(&pool->mutex);
+    while (!(atomic_load(&pool->done) & ~seen) && (pool->pending[COLLECTOR_CHEAP] || pool->pending[COLLECTOR_EXPENSIVE]))
+        if (pthread_cond_timedwait(&pool->finished, &pool->mutex, &ts) == ETIMEDOUT)
+            break;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Hands the collectors that finished their startup run over to the stats
+// thread: their fields are copied from now on and they are scheduled like
+// the others. Returns whether any was.
+BOOL absorb_startup_jobs(startup_pool *pool, system_stats *stats) {
+    if (pool->joined)
+        return FALSE;
+    unsigned fresh = atomic_load_explicit(&pool->done, memory_order_acquire) & ~stats->working.ready;
+    stats->working.ready |= fresh;
+    long long now = monotonic_ns();
+    for (size_t i = 0; i < COLLECTOR_COUNT; i++) {
+        collector *c = &collectors[i];
+        if (!(c->fields & fresh))
+            continue;
+        c->deadline_ns = now + c->interval_ms * 1000000LL;
+        push_deadline_heap(&collector_queue, c);
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    BOOL finished = !pool->pending[COLLECTOR_CHEAP] && !pool->pending[COLLECTOR_EXPENSIVE];
+    pthread_mutex_unlock(&pool->mutex);
+    if (finished) {
+        for (int i = 0; i < pool->thread_count; i++)
+            pthread_join(pool->threads[i], NULL);
+        pool->joined = TRUE;
     }
+    return fresh != 0;
 }
 
-void fetch_battery_charge(char *battery_charge) {
-    NULL_RETURN(battery_charge);
-    strncpy(battery_charge, DEFAULTSTRING, BUFFERSIZE);
+void publish_snapshot(system_stats *stats) {
+    stats->back = atomic_exchange_explicit(&stats->middle, stats->back | SNAPSHOT_FRESH,
+        memory_order_acq_rel) & ~SNAPSHOT_FRESH;
+}
 
-    FILE *f = fopen("/sys/class/power_supply/BAT0/capacity", "r");
-    if (!f)
-        return;
+// Returns the latest complete snapshot, it stays valid until the next call
+const stats_snapshot *acquire_snapshot(system_stats *stats) {
+    if (atomic_load_explicit(&stats->middle, memory_order_relaxed) & SNAPSHOT_FRESH)
+        stats->front = atomic_exchange_explicit(&stats->middle, stats->front,
+            memory_order_acq_rel) & ~SNAPSHOT_FRESH;
+    return &stats->snapshots[stats->front];
+}
 
-    char buffer[BUFFERSIZE] = { 0 };
-    fgets(buffer, BUFFERSIZE, f);
-    strncpy(battery_charge, buffer, BUFFERSIZE);
-    size_t length = strlen(battery_charge);
-    if (battery_charge[length - 1] == '\n') battery_charge[--length] = '\0';
-    if (length < BUFFERSIZE - 1)
-        battery_charge[length] = '%';
-    fclose(f);
+static shared_stats *shared = NULL; // Segment of the daemon this instance renders from
+static unsigned shared_sequence = 0; // Sequence of the last snapshot copied out of it
+static size_t shared_copy_count = 0;
+
+BOOL shared_stats_alive(const shared_stats *segment) {
+    long long age = monotonic_ns() - atomic_load_explicit(&segment->heartbeat_ns, memory_order_relaxed);
+    return age < SHARED_STATS_STALE_MS * 1000000LL;
 }
 
+// Any local user can create the segment, only one of root or of the user
+// running hfetch is rendered, and only if nobody else can write to it
+BOOL shared_stats_trusted(const struct stat *info) {
+    return (info->st_uid == 0 || info->st_uid == getuid()) && !(info->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+// Maps the segment of a running daemon read-only, NULL when there is none
+shared_stats *attach_shared_stats() {
+    int fd = shm_open(SHARED_STATS_NAME, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+    struct stat info;
+    shared_stats *segment = MAP_FAILED;
+    if (!fstat(fd, &info) && shared_stats_trusted(&info) && info.st_size == sizeof(shared_stats))
+        segment = mmap(NULL, sizeof(shared_stats), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED)
+        return NULL;
+    if (segment->magic != SHARED_STATS_MAGIC || segment->size != sizeof(shared_stats) || !shared_stats_alive(segment)) {
+        munmap(segment, sizeof(shared_stats));
+        return NULL;
+    }
+    return segment;
+}
+
+void detach_shared_stats() {
+    munmap(shared, sizeof(shared_stats));
+    shared = NULL;
+}
+
+// Creates the segment for --daemon. One left behind by a daemon that did not
+// exit cleanly is replaced, a live one is not.
+shared_stats *create_shared_stats() {
+    int fd = shm_open(SHARED_STATS_NAME, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 && errno == EEXIST) {
+        shared_stats *running = attach_shared_stats();
+        if (running) {
+            fprintf(stderr, "hfetch: a daemon is already running (pid %d)\n", (int)running->daemon_pid);
+            munmap(running, sizeof(shared_stats));
+            return NULL;
+        }
+        // Fails in the sticky /dev/shm when another user owns the segment
+        if (shm_unlink(SHARED_STATS_NAME) && errno != ENOENT) {
+            fprintf(stderr, "hfetch: " SHARED_STATS_NAME " belongs to another user, not replacing it\n");
+            return NULL;
+        }
+        fd = shm_open(SHARED_STATS_NAME, O_RDWR | O_CREAT | O_EXCL, 0644);
+    }
+    if (fd < 0) {
+        perror("hfetch: shm_open " SHARED_STATS_NAME);
+        return NULL;
+    }
+    // Readable by every user whatever the umask, only the daemon writes
+    fchmod(fd, 0644);
+    shared_stats *segment = MAP_FAILED;
+    if (!ftruncate(fd, sizeof(shared_stats)))
+        segment = mmap(NULL, sizeof(shared_stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        perror("hfetch: mmap " SHARED_STATS_NAME);
+        shm_unlink(SHARED_STATS_NAME);
+        return NULL;
+    }
+    segment->size = sizeof(shared_stats);
+    segment->daemon_pid = getpid();
+    atomic_store(&segment->heartbeat_ns, monotonic_ns());
+    segment->magic = SHARED_STATS_MAGIC;
+    return segment;
+}
+
+void write_shared_stats(shared_stats *segment, const stats_snapshot *snapshot) {
+    unsigned sequence = atomic_load_explicit(&segment->sequence, memory_order_relaxed);
+    atomic_store_explicit(&segment->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    segment->datetime = snapshot->datetime;
+    segment->cpu_usage = snapshot->cpu_usage;
+    segment->meminfo = snapshot->meminfo;
+    segment->process_count = snapshot->process_count;
+    segment->uptime = snapshot->uptime;
+    segment->battery_charge = snapshot->battery_charge;
+    segment->ready = snapshot->ready;
+    segment->disk_count = snapshot->disk_count < SHARED_MAX_DISKS ? snapshot->disk_count : SHARED_MAX_DISKS;
+    segment->gpu_count = snapshot->gpu_count < SHARED_MAX_GPUS ? snapshot->gpu_count : SHARED_MAX_GPUS;
+    segment->core_count = snapshot->core_count < SHARED_MAX_CORES ? snapshot->core_count : SHARED_MAX_CORES;
+    memcpy(segment->disks, snapshot->disks, segment->disk_count * sizeof(disk_stats));
+    memcpy(segment->gpus, snapshot->gpus, segment->gpu_count * sizeof(gpu_stats));
+    memcpy(segment->core_usage, snapshot->core_usage, segment->core_count * sizeof(float));
+
+    atomic_store_explicit(&segment->sequence, sequence + 2, memory_order_release);
+}
+
+// Copies the latest snapshot out of the segment. The counts are clamped and
+// the strings cleaned up before anything is used. Copies are made into a
+// scratch snapshot and only reach the caller's once consistent, a torn copy
+// is retried and after a few torn copies the caller's snapshot is left as is.
+BOOL read_shared_stats(const shared_stats *segment, stats_snapshot *snapshot) {
+    static stats_snapshot scratch = { 0 };
+    if (!scratch.disk_capacity) {
+        scratch.disk_capacity = SHARED_MAX_DISKS;
+        scratch.disks = malloc(SHARED_MAX_DISKS * sizeof(disk_stats));
+        scratch.gpu_capacity = SHARED_MAX_GPUS;
+        scratch.gpus = malloc(SHARED_MAX_GPUS * sizeof(gpu_stats));
+        scratch.core_capacity = SHARED_MAX_CORES;
+        scratch.core_usage = malloc(SHARED_MAX_CORES * sizeof(float));
+    }
+    for (int attempt = 0; attempt < 8; attempt++) {
+        unsigned sequence = atomic_load_explicit(&segment->sequence, memory_order_acquire);
+        if (sequence & 1)
+            continue;
+        scratch.disk_count = segment->disk_count < SHARED_MAX_DISKS ? segment->disk_count : SHARED_MAX_DISKS;
+        scratch.gpu_count = segment->gpu_count < SHARED_MAX_GPUS ? segment->gpu_count : SHARED_MAX_GPUS;
+        scratch.core_count = segment->core_count < SHARED_MAX_CORES ? segment->core_count : SHARED_MAX_CORES;
+        scratch.datetime = segment->datetime;
+        scratch.cpu_usage = segment->cpu_usage;
+        scratch.meminfo = segment->meminfo;
+        scratch.process_count = segment->process_count;
+        scratch.uptime = segment->uptime;
+        scratch.battery_charge = segment->battery_charge;
+        scratch.ready = segment->ready;
+        memcpy(scratch.disks, segment->disks, scratch.disk_count * sizeof(disk_stats));
+        memcpy(scratch.gpus, segment->gpus, scratch.gpu_count * sizeof(gpu_stats));
+        memcpy(scratch.core_usage, segment->core_usage, scratch.core_count * sizeof(float));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&segment->sequence, memory_order_relaxed) != sequence)
+            continue;
+
+        for (size_t i = 0; i < scratch.disk_count; i++) {
+            strip_control_bytes(scratch.disks[i].device, BUFFERSIZE);
+            strip_control_bytes(scratch.disks[i].mount_point, BUFFERSIZE);
+        }
+        for (size_t i = 0; i < scratch.gpu_count; i++)
+            strip_control_bytes(scratch.gpus[i].name, BUFFERSIZE);
+        copy_snapshot(snapshot, &scratch);
+        shared_sequence = sequence;
+        shared_copy_count++;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// Polls the daemon and publishes its snapshots. Returns FALSE once it stopped
+// publishing.
+BOOL update_shared_stats(system_stats *stats) {
+    usleep(SHARED_STATS_POLL_MS * 1000);
+    if (!shared_stats_alive(shared))
+        return FALSE;
+    if (atomic_load_explicit(&shared->sequence, memory_order_relaxed) != shared_sequence
+        && read_shared_stats(shared, &stats->working)) {
+        copy_snapshot(&stats->snapshots[stats->back], &stats->working);
+        publish_snapshot(stats);
+        dynamic_refresh_count++;
+    }
+    return TRUE;
+}
+
+// Starts the collectors and waits for the cheap fields (all of them with --once)
+void start_local_stats(system_stats *stats, BOOL identity) {
+    if (stats->flags.disable_print_gpu)
+        find_collector("gpus", 4)->interval_ms = 0;
+    start_startup_jobs(&startup, stats, identity, TRUE);
+    wait_startup_jobs(&startup, stats->flags.once ? COLLECTOR_EXPENSIVE : COLLECTOR_CHEAP);
+    absorb_startup_jobs(&startup, stats);
+}
+
+// The first snapshot is published once the cheap fields are ready, the others
+// fill in as their collectors finish. With a daemon only the identity strings
+// are fetched here.
 void fetch_stats(system_stats *stats) {
-    fetch_user_name(stats->user_name);
-    fetch_host_name(stats->host_name);
-    fetch_datetime(stats->datetime);
-    fetch_os_name(stats->os_name);
-    fetch_kernel_version(stats->kernel_version);
-    fetch_desktop_name(stats->desktop_name);
-    fetch_shell_name(stats->shell_name);
-    fetch_terminal_name(stats->terminal_name);
-    fetch_cpu_name(stats->cpu_name);
-    fetch_cpu_usage(stats->cpu_usage);
-    fetch_ram_usage(stats->ram_usage);
-    fetch_swap_usage(stats->swap_usage);
-    fetch_disk_usage_multiple(stats->disk_usage,&stats->mount_count);
-    fetch_process_count(stats->process_count);
-    fetch_uptime(stats->uptime);
-    fetch_battery_charge(stats->battery_charge);
-	if(!stats->flags.disable_print_gpu)
-    	fetch_gpu_stats_multiple(stats->gpu_stats,&stats->gpu_count);
+    init_snapshot(&stats->working);
+    for (int i = 0; i < 3; i++)
+        init_snapshot(&stats->snapshots[i]);
+
+    if (shared) {
+        start_startup_jobs(&startup, stats, TRUE, FALSE);
+        BOOL copied = read_shared_stats(shared, &stats->working);
+        wait_startup_jobs(&startup, COLLECTOR_EXPENSIVE);
+        absorb_startup_jobs(&startup, stats);
+        if (!copied) {
+            detach_shared_stats();
+            start_local_stats(stats, FALSE);
+        }
+    } else {
+        start_local_stats(stats, TRUE);
+    }
+
+    copy_snapshot(&stats->snapshots[0], &stats->working);
+    stats->front = 0;
+    stats->back = 1;
+    atomic_init(&stats->middle, 2);
 }
 
+// Longest the stats thread sleeps when no collector is due before, 0 to only
+// wake for the collectors. The daemon wakes often enough to keep its heartbeat fresh.
+static long long max_stats_sleep_ns = 0;
+
+// Sleeps until the earliest collector deadline and runs every collector that
+// is due. Cheap collectors are published before the expensive ones run, so a
+// slow walk over the mounts never holds back the clock.
 void update_dynamic_stats(system_stats *stats) {
-	system_stats tempstats = *stats;
-
-    fetch_datetime(tempstats.datetime);
-    fetch_cpu_usage(tempstats.cpu_usage);
-    fetch_ram_usage(tempstats.ram_usage);
-    fetch_swap_usage(tempstats.swap_usage);
-    fetch_disk_usage_multiple(tempstats.disk_usage,&tempstats.mount_count);
-    fetch_process_count(tempstats.process_count);
-	fetch_uptime(tempstats.uptime);
-    fetch_battery_charge(tempstats.battery_charge);
-	if(!stats->flags.disable_print_gpu)
-    	fetch_gpu_stats_multiple(tempstats.gpu_stats,&tempstats.gpu_count);
+    long long now = monotonic_ns();
+    long long deadline = collector_queue.count ? collector_queue.items[0]->deadline_ns : now + 200000000LL;
+    if (max_stats_sleep_ns && deadline > now + max_stats_sleep_ns)
+        deadline = now + max_stats_sleep_ns;
+    if (!startup.joined) {
+        // A collector that finishes its startup run is published right away
+        wait_startup_collectors(&startup, stats->working.ready, deadline);
+        if (absorb_startup_jobs(&startup, stats)) {
+            copy_snapshot(&stats->snapshots[stats->back], &stats->working);
+            publish_snapshot(stats);
+            dynamic_refresh_count++;
+        }
+    } else {
+        struct timespec ts = { deadline / 1000000000LL, deadline % 1000000000LL };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+    }
+
+    collector *due[COLLECTOR_MAX];
+    size_t due_count = 0;
+    now = monotonic_ns();
+    while (collector_queue.count && collector_queue.items[0]->deadline_ns <= now)
+        due[due_count++] = pop_deadline_heap(&collector_queue);
 
-	pthread_mutex_lock(&stats->mutex);
-	*stats = tempstats;
-	pthread_mutex_unlock(&stats->mutex);
+    for (collector_cost cost = COLLECTOR_CHEAP; cost <= COLLECTOR_EXPENSIVE; cost++) {
+        BOOL changed = FALSE;
+        for (size_t i = 0; i < due_count; i++) {
+            if (due[i]->cost != cost)
+                continue;
+            run_collector(due[i], &stats->working);
+            changed = TRUE;
+        }
+        if (changed) {
+            copy_snapshot(&stats->snapshots[stats->back], &stats->working);
+            publish_snapshot(stats);
+            dynamic_refresh_count++;
+        }
+    }
+
+    // Late collectors are not run twice to catch up, they skip to the next period
+    now = monotonic_ns();
+    for (size_t i = 0; i < due_count; i++) {
+        due[i]->deadline_ns += due[i]->interval_ms * 1000000LL;
+        if (due[i]->deadline_ns < now)
+            due[i]->deadline_ns = now + due[i]->interval_ms * 1000000LL;
+        push_deadline_heap(&collector_queue, due[i]);
+    }
 }
 
-void get_terminal_size(int *columns, int *lines) {
-    *columns = 0; *lines = 0;
-    char buffer[BUFFERSIZE] = { 0 };
-    FILE *f = popen("tput cols", "r");
-    if (!f)
+// Terminal size is only queried again after a SIGWINCH, every other frame
+// reads the cached value
+static terminal_geometry geometry = { 0 };
+static volatile sig_atomic_t geometry_stale = 1;
+
+void handle_winch(int signal) {
+    UNUSED_ARG(signal);
+    geometry_stale = 1;
+}
+
+void refresh_terminal_size(terminal_geometry *geo) {
+    geo->refresh_count++;
+
+    struct winsize ws;
+    if (!ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) && ws.ws_col && ws.ws_row) {
+        geo->columns = ws.ws_col;
+        geo->lines = ws.ws_row;
         return;
-    if (fgets(buffer, BUFFERSIZE, f) != NULL)
-        *columns = atoi(buffer);
-    pclose(f);
+    }
 
-    f = popen("tput lines", "r");
-    if (!f)
+    // Not a tty, fall back to the environment and then to the vt100 default
+    char *value = getenv("COLUMNS");
+    geo->columns = value ? atoi(value) : 0;
+    value = getenv("LINES");
+    geo->lines = value ? atoi(value) : 0;
+    if (geo->columns <= 0) geo->columns = 80;
+    if (geo->lines <= 0) geo->lines = 24;
+}
+
+void get_terminal_size(int *columns, int *lines) {
+    if (geometry_stale) {
+        // Clear before querying so a resize during the ioctl is not lost
+        geometry_stale = 0;
+        refresh_terminal_size(&geometry);
+    }
+    *columns = geometry.columns;
+    *lines = geometry.lines;
+}
+
+// A frame is composed in one buffer and sent with a single write(), so the
+// terminal never sees half of it. Every byte goes through emit() so it can
+// be counted.
+static output_buffer frame_buffer = { 0 };
+static size_t frame_start = 0; // Where the frame's content begins, after the sync escape
+static BOOL synchronized_output = FALSE;
+static size_t output_bytes = 0, stats_bytes = 0, frame_count = 0, write_calls = 0;
+static struct timespec program_start;
+
+#define BEGIN_SYNCHRONIZED_UPDATE "\033[?2026h"
+#define END_SYNCHRONIZED_UPDATE "\033[?2026l"
+
+int emit(const char *format, ...) {
+    va_list args;
+    reserve_output_buffer(&frame_buffer, BUFFERSIZE);
+    size_t available = frame_buffer.reserved_size - frame_buffer.length;
+    va_start(args, format);
+    int written = vsnprintf(frame_buffer.data + frame_buffer.length, available, format, args);
+    va_end(args);
+    if (written < 0)
+        return written;
+    if ((size_t)written >= available) {
+        reserve_output_buffer(&frame_buffer, written + 1);
+        va_start(args, format);
+        vsnprintf(frame_buffer.data + frame_buffer.length, written + 1, format, args);
+        va_end(args);
+    }
+    frame_buffer.length += written;
+    return written;
+}
+
+void begin_frame() {
+    frame_buffer.length = 0;
+    if (synchronized_output)
+        append_output_buffer(&frame_buffer, BEGIN_SYNCHRONIZED_UPDATE, sizeof(BEGIN_SYNCHRONIZED_UPDATE) - 1);
+    frame_start = frame_buffer.length;
+}
+
+// Sends the composed frame, write() is only called again after a short write
+void end_frame() {
+    if (frame_buffer.length == frame_start)
         return;
-    if (fgets(buffer, BUFFERSIZE, f) != NULL)
-        *lines = atoi(buffer);
-    pclose(f);
+    if (synchronized_output)
+        append_output_buffer(&frame_buffer, END_SYNCHRONIZED_UPDATE, sizeof(END_SYNCHRONIZED_UPDATE) - 1);
+    size_t sent = 0;
+    while (sent < frame_buffer.length) {
+        write_calls++;
+        ssize_t n = write(STDOUT_FILENO, frame_buffer.data + sent, frame_buffer.length - sent);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    output_bytes += sent;
+    frame_count++;
+    begin_frame();
+}
+
+// Asks the terminal whether it knows mode 2026 (DECRQM) followed by a primary
+// device attributes request. Every terminal answers DA1, so a missing DECRQM
+// reply before it means the mode is unsupported, without waiting for a timeout.
+BOOL detect_synchronized_output() {
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO))
+        return FALSE;
+    struct termios saved, raw;
+    if (tcgetattr(STDIN_FILENO, &saved))
+        return FALSE;
+    raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+    const char query[] = "\033[?2026$p\033[c";
+    write_calls++;
+    if (write(STDOUT_FILENO, query, sizeof(query) - 1) < 0) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+        return FALSE;
+    }
+
+    char reply[BUFFERSIZE];
+    size_t length = 0;
+    BOOL answered = FALSE;
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+    while (!answered && length < sizeof(reply) - 1 && poll(&pfd, 1, 250) > 0) {
+        ssize_t n = read(STDIN_FILENO, reply + length, sizeof(reply) - 1 - length);
+        if (n <= 0)
+            break;
+        length += n;
+        reply[length] = '\0';
+        // The DA1 reply is the last one, ESC [ ? ... c
+        char *da1 = strstr(reply, "\033[?");
+        while (da1 && !answered) {
+            size_t span = strspn(da1 + 3, "0123456789;");
+            answered = da1[3 + span] == 'c';
+            da1 = strstr(da1 + 3, "\033[?");
+        }
+    }
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+
+    // ESC [ ? 2026 ; Ps $ y, 1 and 2 are set and reset, 0 and 4 mean unsupported
+    reply[length] = '\0';
+    char *mode = strstr(reply, "\033[?2026;");
+    return mode && (mode[8] == '1' || mode[8] == '2') && mode[9] == '$';
 }
 
-void clear_screen(int columns, int lines) {
-    printf(POS COLOR_RESET, 0, 0);
+// Last text drawn on each stats line, only lines whose text changed are repainted
+static render_cache stats_cache = { .invalid = TRUE };
+
+void invalidate_render_cache(render_cache *cache) {
+    cache->invalid = TRUE;
+}
+
+void clear_screen() {
+    int columns, lines;
+    get_terminal_size(&columns, &lines);
+
+    char row[BUFFERSIZE + 1];
+    memset(row, ' ', BUFFERSIZE);
+    emit(POS COLOR_RESET, 0, 0);
     for (int y = 1; y < lines + 1; y++) {
-        printf(POS, y, 0);
-        for (int x = 0; x < columns; x++)
-            putchar(' ');
+        emit(POS, y, 0);
+        for (int x = 0; x < columns; x += BUFFERSIZE)
+            emit("%.*s", columns - x < BUFFERSIZE ? columns - x : BUFFERSIZE, row);
     }
+    invalidate_render_cache(&stats_cache);
+    reset_animation(&cliorb);
 }
 
 void print_logo() {
-    //printf(POS "%s", 0, 0, arch_logo_8x15);
-    //printf(POS COLOR_CYAN "%s" COLOR_RESET, 0, 0, arch_logo_wide);
-    printf(yield_frame(&cliorb));
+    yield_frame(&cliorb, &frame_buffer);
+}
+
+void print_stats_line(render_cache *cache, int line, int column, const char *format, ...) {
+    char text[STATS_LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, STATS_LINE_SIZE, format, args);
+    va_end(args);
+
+    if (line <= STATS_MAX_LINES) {
+        char *cached = cache->lines[line - 1];
+        if (!cache->invalid && line <= cache->line_count && !strcmp(cached, text))
+            return;
+        strcpy(cached, text);
+    }
+    if (cache->detached)
+        return;
+    // Erasing to the end of the line removes what is left of a longer previous text
+    int written = emit(POS COLOR_RESET "%s" ERASELINE, line, column, text);
+    if (written > 0)
+        stats_bytes += written;
+}
+
+// Prints "used / total (percent)" in GB, or the default string when the total is unknown
+void format_capacity(char *buffer, double used_gb, double total_gb, int precision) {
+    if (total_gb > 0)
+        snprintf(buffer, BUFFERSIZE, "%.*fGB / %.*fGB (%.0f%%)",
+            precision, used_gb, precision, total_gb, used_gb / total_gb * 100);
+    else
+        strncpy(buffer, DEFAULTSTRING, BUFFERSIZE);
 }
 
-void draw_line(int length) {
-    int x = 0;
-    while (x++ < length)
-        putchar('-');
+// Draws the busy fraction of the cores as a strip of block elements, with the
+// cores averaged into at most CPU_STRIP_WIDTH characters
+void format_core_strip(char *buffer, const float *usage, size_t count) {
+    static const char *levels[] = { "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█" };
+    size_t width = count < CPU_STRIP_WIDTH ? count : CPU_STRIP_WIDTH;
+    float sums[CPU_STRIP_WIDTH] = { 0 };
+    for (size_t i = 0; i < count; i++)
+        sums[i * width / count] += usage[i];
+
+    char *p = buffer;
+    for (size_t b = 0; b < width; b++) {
+        // Cores i with i * width / count == b
+        size_t first = (b * count + width - 1) / width,
+               end = ((b + 1) * count + width - 1) / width;
+        int level = (int)(sums[b] / (end - first) * 7 + 0.5f);
+        level = level < 0 ? 0 : level > 7 ? 7 : level;
+        size_t length = strlen(levels[level]);
+        memcpy(p, levels[level], length);
+        p += length;
+    }
+    *p = '\0';
 }
 
-void print_stats(system_stats stats) {
+// Values are formatted here rather than by the stats thread, only what is drawn is formatted
+void print_stats(const system_stats *stats, const stats_snapshot *snapshot) {
+    render_cache *cache = &stats_cache;
+    char value[BUFFERSIZE];
     int line = 1,
         column = PADDING + 2;
-    int namelen = strlen(stats.user_name) + strlen(stats.host_name) + 1;
-    printf(POS COLOR_RESET COLOR_CYAN "%*shfetch📚⚔️" COLOR_RESET, line++, column, (namelen - 8) / 2, "");
-    printf(POS COLOR_CYAN "%s" COLOR_RESET "@" COLOR_CYAN "%s" COLOR_RESET, line++, column, stats.user_name, stats.host_name);
-    printf(POS, line++, column);
-    draw_line(namelen);
-    printf(POS COLOR_CYAN "Datetime:  " COLOR_RESET " %s", line++, column, stats.datetime);
-    printf(POS COLOR_CYAN "OS:        " COLOR_RESET " %s", line++, column, stats.os_name);
-    printf(POS COLOR_CYAN "Kernel:    " COLOR_RESET " %s", line++, column, stats.kernel_version);
-    printf(POS COLOR_CYAN "Desktop:   " COLOR_RESET " %s", line++, column, stats.desktop_name);
-    printf(POS COLOR_CYAN "Shell:     " COLOR_RESET " %s", line++, column, stats.shell_name);
-    printf(POS COLOR_CYAN "Terminal:  " COLOR_RESET " %s", line++, column, stats.terminal_name);
-    printf(POS COLOR_CYAN "CPU:       " COLOR_RESET " %s", line++, column, stats.cpu_name);
-    printf(POS COLOR_CYAN "CPU Usage: " COLOR_RESET " %s  ", line++, column, stats.cpu_usage);
-	if(!stats.flags.disable_print_gpu)
-		for(int i=0;i<stats.gpu_count;i++)
+    int namelen = strlen(stats->user_name) + strlen(stats->host_name) + 1;
+    char rule[BUFFERSIZE * 2 + 1];
+    memset(rule, '-', namelen);
+    rule[namelen] = '\0';
+    print_stats_line(cache, line++, column, COLOR_CYAN "%*shfetch📚⚔️" COLOR_RESET, (namelen - 8) / 2, "");
+    print_stats_line(cache, line++, column, COLOR_CYAN "%s" COLOR_RESET "@" COLOR_CYAN "%s" COLOR_RESET, stats->user_name, stats->host_name);
+    print_stats_line(cache, line++, column, "%s", rule);
+
+    struct tm local;
+    if (snapshot->datetime == -1 || !localtime_r(&snapshot->datetime, &local)
+        || !strftime(value, BUFFERSIZE, "%Y-%m-%d %H:%M:%S", &local))
+        strncpy(value, DEFAULTSTRING, BUFFERSIZE);
+    print_stats_line(cache, line++, column, COLOR_CYAN "Datetime:  " COLOR_RESET " %s", value);
+    print_stats_line(cache, line++, column, COLOR_CYAN "OS:        " COLOR_RESET " %s", stats->os_name);
+    print_stats_line(cache, line++, column, COLOR_CYAN "Kernel:    " COLOR_RESET " %s", stats->kernel_version);
+    print_stats_line(cache, line++, column, COLOR_CYAN "Desktop:   " COLOR_RESET " %s", stats->desktop_name);
+    print_stats_line(cache, line++, column, COLOR_CYAN "Shell:     " COLOR_RESET " %s", stats->shell_name);
+    print_stats_line(cache, line++, column, COLOR_CYAN "Terminal:  " COLOR_RESET " %s", stats->terminal_name);
+    print_stats_line(cache, line++, column, COLOR_CYAN "CPU:       " COLOR_RESET " %s", stats->cpu_name);
+    if (snapshot->cpu_usage >= 0 && snapshot->core_count > 1) {
+        char percent[8], strip[CPU_STRIP_WIDTH * 3 + 1];
+        snprintf(percent, sizeof(percent), "%.0f%%", snapshot->cpu_usage);
+        format_core_strip(strip, snapshot->core_usage, snapshot->core_count);
+        snprintf(value, BUFFERSIZE, "%-5s%s", percent, strip);
+    } else if (snapshot->cpu_usage >= 0)
+        snprintf(value, BUFFERSIZE, "%.0f%%", snapshot->cpu_usage);
+    else
+        strncpy(value, DEFAULTSTRING, BUFFERSIZE);
+    print_stats_line(cache, line++, column, COLOR_CYAN "CPU Usage: " COLOR_RESET " %s", value);
+	if(!stats->flags.disable_print_gpu)
+		for(size_t i=0;i<snapshot->gpu_count;i++)
 		{
-			printf(POS COLOR_CYAN "GPU:       " COLOR_RESET " %s %s", line++, column, stats.gpu_stats[i][0], stats.gpu_stats[i][2]);
-			printf(POS COLOR_CYAN "GPU VRAM:  " COLOR_RESET " %s", line++, column, stats.gpu_stats[i][1]);
+			const gpu_stats *gpu = &snapshot->gpus[i];
+			if (gpu->activity >= 0)
+				print_stats_line(cache, line++, column, COLOR_CYAN "GPU:       " COLOR_RESET " %s (%d%%)", gpu->name, gpu->activity);
+			else
+				print_stats_line(cache, line++, column, COLOR_CYAN "GPU:       " COLOR_RESET " %s", gpu->name);
+			format_capacity(value, gpu->vram_used_mib / 1024., gpu->vram_total_mib / 1024., 2);
+			print_stats_line(cache, line++, column, COLOR_CYAN "GPU VRAM:  " COLOR_RESET " %s", value);
 		}
-    printf(POS COLOR_CYAN "Memory:    " COLOR_RESET " %s   ", line++, column, stats.ram_usage);
-    printf(POS COLOR_CYAN "Swap:      " COLOR_RESET " %s   ", line++, column, stats.swap_usage);
-    for(int i=0;i<stats.mount_count;i++)
+    format_ram_usage(value, &snapshot->meminfo);
+    print_stats_line(cache, line++, column, COLOR_CYAN "Memory:    " COLOR_RESET " %s", value);
+    format_swap_usage(value, &snapshot->meminfo);
+    print_stats_line(cache, line++, column, COLOR_CYAN "Swap:      " COLOR_RESET " %s", value);
+    for(size_t i=0;i<snapshot->disk_count;i++)
     {
-        printf(POS COLOR_CYAN "Disk:      " COLOR_RESET " %s", line++, column, stats.disk_usage[i][0]);
-        if(!stats.flags.disable_print_disk_usage)
-            printf(POS COLOR_CYAN "Disk Usage:" COLOR_RESET " %s  ", line++, column, stats.disk_usage[i][1]);
+        const disk_stats *disk = &snapshot->disks[i];
+        print_stats_line(cache, line++, column, COLOR_CYAN "Disk:      " COLOR_RESET " %s at %s", disk->device, disk->mount_point);
+        if(!stats->flags.disable_print_disk_usage)
+        {
+            format_capacity(value, (double)disk->used_bytes / 1024 / 1024 / 1024,
+                (double)disk->total_bytes / 1024 / 1024 / 1024, 1);
+            print_stats_line(cache, line++, column, COLOR_CYAN "Disk Usage:" COLOR_RESET " %s%s", value,
+                disk->stale ? " (stale)" : "");
+        }
     }
-    printf(POS COLOR_CYAN "Processes: " COLOR_RESET " %s    ", line++, column, stats.process_count);
-    printf(POS COLOR_CYAN "Uptime:    " COLOR_RESET " %s", line++, column, stats.uptime);
-    if(strcmp(stats.battery_charge,DEFAULTSTRING)!=0)
-        printf(POS COLOR_CYAN "Battery:   " COLOR_RESET " %s   ", line++, column, stats.battery_charge);
+    if (snapshot->process_count >= 0)
+        snprintf(value, BUFFERSIZE, "%ld", snapshot->process_count);
+    else
+        strncpy(value, DEFAULTSTRING, BUFFERSIZE);
+    print_stats_line(cache, line++, column, COLOR_CYAN "Processes: " COLOR_RESET " %s", value);
+    if (snapshot->uptime >= 0)
+        snprintf(value, BUFFERSIZE, "%02ld:%02ld:%02ld:%02ld", snapshot->uptime / 86400,
+            (snapshot->uptime / 3600) % 24, snapshot->uptime % 3600 / 60, snapshot->uptime % 60);
+    else
+        strncpy(value, DEFAULTSTRING, BUFFERSIZE);
+    print_stats_line(cache, line++, column, COLOR_CYAN "Uptime:    " COLOR_RESET " %s", value);
+    if(snapshot->battery_charge >= 0)
+        print_stats_line(cache, line++, column, COLOR_CYAN "Battery:   " COLOR_RESET " %d%%", snapshot->battery_charge);
+
+    // Erase lines left over from a longer previous frame (e.g. an unmounted disk)
+    if (!cache->invalid)
+        for (int y = line; y <= cache->line_count; y++)
+            stats_bytes += emit(POS ERASELINE, y, column);
+    cache->line_count = line - 1;
+    cache->invalid = FALSE;
 }
 
-void handle_exit(int signal) {
+static frame_pacer pacer = { .period_ns = 1000000000LL / FPS, .render_min_ns = -1 };
+static struct termios saved_termios, raw_termios;
+static volatile sig_atomic_t focus_reporting = FALSE;
+static volatile sig_atomic_t screen_stale = 0; // Drawn over while hfetch was stopped
+
+#define ENABLE_FOCUS_REPORTING "\033[?1004h" HIDECURSOR
+#define DISABLE_FOCUS_REPORTING "\033[?1004l" SHOWCURSOR
+
+// For the signal handlers and atexit(), which cannot go through emit()
+void write_escape(const char *escape, size_t length) {
+    while (length) {
+        ssize_t n = write(STDOUT_FILENO, escape, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        escape += n;
+        length -= n;
+    }
+}
+
+// Gives the shell its tty back on exits that skip finish_animation()
+void restore_terminal() {
+    if (!focus_reporting)
+        return;
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios);
+    write_escape(DISABLE_FOCUS_REPORTING, sizeof(DISABLE_FOCUS_REPORTING) - 1);
+    focus_reporting = FALSE;
+}
+
+// ^Z: the tty is restored before stopping and set up again on SIGCONT
+void handle_tstp(int signum) {
+    UNUSED_ARG(signum);
+    int saved_errno = errno;
+    if (focus_reporting) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios);
+        write_escape(DISABLE_FOCUS_REPORTING, sizeof(DISABLE_FOCUS_REPORTING) - 1);
+    }
+    sigset_t tstp;
+    sigemptyset(&tstp);
+    sigaddset(&tstp, SIGTSTP);
+    signal(SIGTSTP, SIG_DFL);
+    sigprocmask(SIG_UNBLOCK, &tstp, NULL);
+    raise(SIGTSTP);
+    signal(SIGTSTP, handle_tstp);
+    errno = saved_errno;
+}
+
+void handle_cont(int signal) {
     UNUSED_ARG(signal);
+    int saved_errno = errno;
+    if (focus_reporting) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw_termios);
+        write_escape(ENABLE_FOCUS_REPORTING, sizeof(ENABLE_FOCUS_REPORTING) - 1);
+    }
+    screen_stale = 1;
+    errno = saved_errno;
+}
 
-    int columns, lines;
-    get_terminal_size(&columns, &lines);
-    clear_screen(columns, lines);
-    print_stats(sysstats);
-    print_logo();
+// Focus reports (mode 1004) tell when the terminal is not in front. The tty
+// stops echoing meanwhile so the reports do not end up on the screen.
+void enable_focus_reporting() {
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved_termios))
+        return;
+    raw_termios = saved_termios;
+    raw_termios.c_lflag &= ~(ICANON | ECHO);
+    raw_termios.c_cc[VMIN] = 0;
+    raw_termios.c_cc[VTIME] = 0;
+    atexit(restore_terminal);
+    signal(SIGTSTP, handle_tstp);
+    signal(SIGCONT, handle_cont);
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw_termios);
+    focus_reporting = TRUE;
+    emit("\033[?1004h");
+}
+
+void disable_focus_reporting() {
+    if (!focus_reporting)
+        return;
+    emit("\033[?1004l");
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios);
+    focus_reporting = FALSE;
+}
+
+// Reads pending input without blocking, the last focus report wins
+void read_focus_reports(frame_pacer *fp) {
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+    char input[BUFFERSIZE];
+    while (focus_reporting && poll(&pfd, 1, 0) > 0) {
+        ssize_t n = read(STDIN_FILENO, input, sizeof(input));
+        if (n <= 0)
+            break;
+        for (ssize_t i = 0; i + 2 < n; i++)
+            if (input[i] == '\033' && input[i + 1] == '[' && (input[i + 2] == 'I' || input[i + 2] == 'O'))
+                fp->unfocused = input[i + 2] == 'O';
+    }
+}
 
+// Called after a frame was written. Frames are due on a fixed grid of
+// absolute deadlines, so render time does not add up into drift. When the
+// loop falls behind, the missed animation frames are dropped instead of being
+// drawn in a burst. Unfocused or blocked output slows down to IDLE_FPS.
+void pace_frame(frame_pacer *fp, long long frame_start, long long write_start) {
+    long long now = monotonic_ns();
+    long long render_ns = now - frame_start;
+    if (fp->render_min_ns < 0 || render_ns < fp->render_min_ns)
+        fp->render_min_ns = render_ns;
+    if (render_ns > fp->render_max_ns)
+        fp->render_max_ns = render_ns;
+    fp->render_total_ns += render_ns;
+    fp->frames++;
+
+    // The terminal is not draining its input (scrolled back, paused with ^S, ...)
+    fp->blocked = now - write_start > BLOCKED_WRITE_MS * 1000000LL;
+    read_focus_reports(fp);
+    BOOL idle = fp->unfocused || fp->blocked;
+    long long period = idle ? 1000000000LL / IDLE_FPS : fp->period_ns;
+    if (idle)
+        fp->idle_frames++;
+
+    fp->deadline_ns += period;
+    if (now > fp->deadline_ns) {
+        long long behind = (now - fp->deadline_ns) / period + 1;
+        fp->late_frames++;
+        if (!idle) {
+            fp->skipped_frames += behind;
+            skip_animation_frames(&cliorb, behind);
+        }
+        fp->deadline_ns += behind * period;
+    }
+    struct timespec ts = { fp->deadline_ns / 1000000000LL, fp->deadline_ns % 1000000000LL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static metrics_output metrics = {
+    .fd = STDOUT_FILENO,
+    .period_ns = METRICS_DEFAULT_RATE_MS * 1000000LL,
+};
+
+void print_debug_counters() {
+    printf("Geometry refreshes: %zu\n", geometry.refresh_count);
+
+    const proc_source *sources[] = { &stat_source, &meminfo_source, &mounts_source, &battery_source };
+    size_t opens = 0, reads = 0;
+    for (size_t i = 0; i < sizeof(sources) / sizeof(*sources); i++) {
+        opens += sources[i]->open_calls;
+        reads += sources[i]->read_calls;
+    }
+    printf("Startup jobs: %zu on %d threads, cheap done after %.2f ms, expensive after %.2f ms\n",
+        startup.job_count, startup.thread_count, startup.finished_ns[COLLECTOR_CHEAP] / 1e6,
+        startup.finished_ns[COLLECTOR_EXPENSIVE] / 1e6);
+    printf("Dynamic stat refreshes: %zu\n", dynamic_refresh_count);
+    if (metrics.sequence)
+        printf("Metrics records: %zu, bytes: %zu, skipped periods: %zu\n",
+            (size_t)metrics.sequence, metrics.bytes, metrics.skipped_periods);
+    if (shared_copy_count)
+        printf("Snapshots copied from the daemon: %zu%s\n", shared_copy_count,
+            shared ? "" : ", sampling locally since it stopped");
+    printf("Mount table parses: %zu, stale disk samples: %zu\n", mounts.parse_count, disks.stale_count);
+    printf("Proc source opens: %zu, reads: %zu (%.1f per refresh)\n",
+        opens, reads, dynamic_refresh_count ? (double)reads / dynamic_refresh_count : 0.0);
+    size_t drm_reads = 0;
+    for (size_t i = 0; i < drm_card_count; i++)
+        drm_reads += drm_cards[i].vram_used.read_calls + drm_cards[i].vram_total.read_calls + drm_cards[i].busy_percent.read_calls;
+    printf("DRM cards: %zu, sysfs reads: %zu\n", drm_card_count, drm_reads);
+    for (size_t i = 0; i < GPU_SESSION_COUNT; i++)
+        printf("GPU session %s: spawns %zu, reads %zu, records %zu\n", gpu_sessions[i].argv[0],
+            gpu_sessions[i].stream.spawn_count, gpu_sessions[i].stream.read_calls, gpu_sessions[i].stream.record_count);
+    printf("Collector runs:");
+    for (size_t i = 0; i < COLLECTOR_COUNT; i++)
+        printf(" %s %zu", collectors[i].name, collectors[i].run_count);
     printf("\n");
-    system("tput cnorm");
-    exit(0);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = (now.tv_sec - program_start.tv_sec) + (now.tv_nsec - program_start.tv_nsec) / 1e9;
+    printf("Bytes written: %zu (%.0f bytes/s), stats: %zu (%.0f bytes/s)\n",
+        output_bytes, output_bytes / seconds, stats_bytes, stats_bytes / seconds);
+    printf("Frames: %zu, write() calls: %zu (%.2f per frame), synchronized output: %s\n",
+        frame_count, write_calls, frame_count ? (double)write_calls / frame_count : 0.0,
+        synchronized_output ? "yes" : "no");
+    if (pacer.frames)
+        printf("Frame time: min %.2f ms, avg %.2f ms, max %.2f ms at %.0f fps, late %zu, skipped %zu, idle %zu\n",
+            pacer.render_min_ns / 1e6, pacer.render_total_ns / 1e6 / pacer.frames, pacer.render_max_ns / 1e6,
+            1e9 / pacer.period_ns, pacer.late_frames, pacer.skipped_frames, pacer.idle_frames);
 }
 
-volatile char stopprog = 0;
+// Draws one frame laid out line by line, so that it scrolls with the rest of
+// the shell output, and sends it with a single write()
+void print_once(const system_stats *stats) {
+    stats_cache.detached = TRUE;
+    invalidate_render_cache(&stats_cache);
+    print_stats(stats, &stats->working);
+
+    begin_frame();
+    // Only the lines that fit the render cache were recorded
+    int lines = stats_cache.line_count < STATS_MAX_LINES ? stats_cache.line_count : STATS_MAX_LINES;
+    int rows = lines > cliorb.height ? lines : cliorb.height;
+    for (int y = 0; y < rows; y++) {
+        if (y < cliorb.height)
+            encode_animation_row(&cliorb, y, &frame_buffer);
+        if (y < lines)
+            emit(COLUMN "%s", PADDING + 2, stats_cache.lines[y]);
+        emit(COLOR_RESET "\n");
+    }
+    end_frame();
+}
+
+// Number formatting for the metrics records. snprintf() parses its format
+// and goes through the locale on every call, these only write digits.
+char *format_unsigned(char *p, uint64_t value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (n)
+        *p++ = digits[--n];
+    return p;
+}
+
+// Writes null for the negative values that mark unknown fields
+char *format_optional(char *p, int64_t value) {
+    if (value < 0) {
+        memcpy(p, "null", 4);
+        return p + 4;
+    }
+    return format_unsigned(p, value);
+}
+
+// Writes a fixed-point number with two decimals
+char *format_hundredths(char *p, uint64_t hundredths) {
+    p = format_unsigned(p, hundredths / 100);
+    *p++ = '.';
+    *p++ = '0' + hundredths / 10 % 10;
+    *p++ = '0' + hundredths % 10;
+    return p;
+}
+
+// Per-core usage in hundredths of a percent. Snapshots attached from a
+// daemon may hold anything, and a float out of range is undefined when
+// converted to an unsigned type, so the value is clamped first (NaN to 0).
+uint16_t core_usage_hundredths(float usage) {
+    if (!(usage > 0))
+        return 0;
+    if (usage > 1)
+        return 10000;
+    return usage * 10000 + 0.5f;
+}
+
+// Overall CPU usage in hundredths of a percent, -1 when unknown. Clamped to
+// 100% before the conversion for the same reason as the per-core values.
+int32_t cpu_usage_hundredths(double usage) {
+    if (!(usage >= 0))
+        return -1;
+    if (usage > 100)
+        return 10000;
+    return usage * 100 + 0.5;
+}
+
+// Writes at most 6 bytes per character of s, for \u00XX
+char *format_json_string(char *p, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    *p++ = '"';
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c < 0x20) {
+            memcpy(p, "\\u00", 4);
+            p += 4;
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 15];
+        } else {
+            *p++ = c;
+        }
+    }
+    *p++ = '"';
+    return p;
+}
+
+#define APPEND_LITERAL(p, literal) (memcpy(p, literal, sizeof(literal) - 1), (p) + sizeof(literal) - 1)
+
+// The buffer is reserved for the longest possible record up front, the
+// fields are then written without bounds checks
+void encode_json_record(output_buffer *out, const stats_snapshot *snapshot, uint64_t sequence, int64_t time_ms) {
+    reserve_output_buffer(out, 512 + snapshot->core_count * 8
+        + snapshot->gpu_count * (BUFFERSIZE * 6 + 128) + snapshot->disk_count * (BUFFERSIZE * 12 + 128));
+    char *p = out->data + out->length;
+
+    p = APPEND_LITERAL(p, "{\"seq\":");
+    p = format_unsigned(p, sequence);
+    p = APPEND_LITERAL(p, ",\"time_ms\":");
+    p = format_optional(p, time_ms);
+    p = APPEND_LITERAL(p, ",\"uptime\":");
+    p = format_optional(p, snapshot->uptime);
+    p = APPEND_LITERAL(p, ",\"cpu\":");
+    int32_t cpu_usage = cpu_usage_hundredths(snapshot->cpu_usage);
+    if (cpu_usage >= 0)
+        p = format_hundredths(p, cpu_usage);
+    else
+        p = APPEND_LITERAL(p, "null");
+    p = APPEND_LITERAL(p, ",\"cores\":[");
+    for (size_t i = 0; i < snapshot->core_count; i++) {
+        if (i)
+            *p++ = ',';
+        p = format_hundredths(p, core_usage_hundredths(snapshot->core_usage[i]));
+    }
+
+    const meminfo_snapshot *meminfo = &snapshot->meminfo;
+    p = APPEND_LITERAL(p, "],\"memory\":");
+    if ((meminfo->present & (MEMINFO_MEM_TOTAL | MEMINFO_MEM_AVAILABLE)) == (MEMINFO_MEM_TOTAL | MEMINFO_MEM_AVAILABLE)) {
+        p = APPEND_LITERAL(p, "{\"total_kB\":");
+        p = format_unsigned(p, meminfo->mem_total_kB);
+        p = APPEND_LITERAL(p, ",\"available_kB\":");
+        p = format_unsigned(p, meminfo->mem_available_kB);
+        *p++ = '}';
+    } else {
+        p = APPEND_LITERAL(p, "null");
+    }
+    p = APPEND_LITERAL(p, ",\"swap\":");
+    if ((meminfo->present & (MEMINFO_SWAP_TOTAL | MEMINFO_SWAP_FREE)) == (MEMINFO_SWAP_TOTAL | MEMINFO_SWAP_FREE)) {
+        p = APPEND_LITERAL(p, "{\"total_kB\":");
+        p = format_unsigned(p, meminfo->swap_total_kB);
+        p = APPEND_LITERAL(p, ",\"free_kB\":");
+        p = format_unsigned(p, meminfo->swap_free_kB);
+        *p++ = '}';
+    } else {
+        p = APPEND_LITERAL(p, "null");
+    }
+    p = APPEND_LITERAL(p, ",\"processes\":");
+    p = format_optional(p, snapshot->process_count);
+    p = APPEND_LITERAL(p, ",\"battery\":");
+    p = format_optional(p, snapshot->battery_charge);
+
+    p = APPEND_LITERAL(p, ",\"gpus\":[");
+    for (size_t i = 0; i < snapshot->gpu_count; i++) {
+        const gpu_stats *gpu = &snapshot->gpus[i];
+        if (i)
+            *p++ = ',';
+        p = APPEND_LITERAL(p, "{\"name\":");
+        p = format_json_string(p, gpu->name);
+        p = APPEND_LITERAL(p, ",\"vram_used_mib\":");
+        p = format_unsigned(p, gpu->vram_used_mib);
+        p = APPEND_LITERAL(p, ",\"vram_total_mib\":");
+        p = format_unsigned(p, gpu->vram_total_mib);
+        p = APPEND_LITERAL(p, ",\"activity\":");
+        p = format_optional(p, gpu->activity);
+        *p++ = '}';
+    }
+    p = APPEND_LITERAL(p, "],\"disks\":[");
+    for (size_t i = 0; i < snapshot->disk_count; i++) {
+        const disk_stats *disk = &snapshot->disks[i];
+        if (i)
+            *p++ = ',';
+        p = APPEND_LITERAL(p, "{\"device\":");
+        p = format_json_string(p, disk->device);
+        p = APPEND_LITERAL(p, ",\"mount\":");
+        p = format_json_string(p, disk->mount_point);
+        p = APPEND_LITERAL(p, ",\"used_bytes\":");
+        p = format_unsigned(p, disk->used_bytes);
+        p = APPEND_LITERAL(p, ",\"total_bytes\":");
+        p = format_unsigned(p, disk->total_bytes);
+        if (disk->stale)
+            p = APPEND_LITERAL(p, ",\"stale\":true}");
+        else
+            p = APPEND_LITERAL(p, ",\"stale\":false}");
+    }
+    p = APPEND_LITERAL(p, "]}\n");
+    out->length = p - out->data;
+}
+
+void encode_binary_record(output_buffer *out, const stats_snapshot *snapshot, uint64_t sequence, int64_t time_ms) {
+    const meminfo_snapshot *meminfo = &snapshot->meminfo;
+    metrics_record record = {
+        .magic = METRICS_RECORD_MAGIC,
+        .sequence = sequence,
+        .time_ms = time_ms,
+        .uptime = snapshot->uptime,
+        .mem_total_kB = meminfo->present & MEMINFO_MEM_TOTAL ? meminfo->mem_total_kB : 0,
+        .mem_available_kB = meminfo->present & MEMINFO_MEM_AVAILABLE ? meminfo->mem_available_kB : 0,
+        .swap_total_kB = meminfo->present & MEMINFO_SWAP_TOTAL ? meminfo->swap_total_kB : 0,
+        .swap_free_kB = meminfo->present & MEMINFO_SWAP_FREE ? meminfo->swap_free_kB : 0,
+        .cpu_usage = cpu_usage_hundredths(snapshot->cpu_usage),
+        .process_count = snapshot->process_count,
+        .battery_charge = snapshot->battery_charge,
+        .ready = snapshot->ready,
+        .gpu_count = snapshot->gpu_count < UINT16_MAX ? snapshot->gpu_count : UINT16_MAX,
+        .disk_count = snapshot->disk_count < UINT16_MAX ? snapshot->disk_count : UINT16_MAX,
+        .core_count = snapshot->core_count < UINT16_MAX ? snapshot->core_count : UINT16_MAX,
+    };
+    // Padded so that the next record starts 8-byte aligned
+    size_t cores_size = (record.core_count * sizeof(uint16_t) + 7) & ~(size_t)7;
+    record.size = sizeof(record) + record.gpu_count * sizeof(metrics_gpu)
+        + record.disk_count * sizeof(metrics_disk) + cores_size;
+
+    reserve_output_buffer(out, record.size);
+    char *p = out->data + out->length;
+    memcpy(p, &record, sizeof(record));
+    p += sizeof(record);
+    for (size_t i = 0; i < record.gpu_count; i++) {
+        const gpu_stats *gpu = &snapshot->gpus[i];
+        metrics_gpu entry = { gpu->vram_used_mib, gpu->vram_total_mib, gpu->activity, 0 };
+        memcpy(p, &entry, sizeof(entry));
+        p += sizeof(entry);
+    }
+    for (size_t i = 0; i < record.disk_count; i++) {
+        const disk_stats *disk = &snapshot->disks[i];
+        metrics_disk entry = { disk->used_bytes, disk->total_bytes, disk->stale, 0 };
+        memcpy(p, &entry, sizeof(entry));
+        p += sizeof(entry);
+    }
+    memset(p, 0, cores_size);
+    for (size_t i = 0; i < record.core_count; i++) {
+        uint16_t usage = core_usage_hundredths(snapshot->core_usage[i]);
+        memcpy(p + i * sizeof(usage), &usage, sizeof(usage));
+    }
+    out->length += record.size;
+}
+
+// Connects to the --socket reader, the records go to stdout otherwise
+BOOL open_metrics_output(metrics_output *out) {
+    if (!out->socket_path)
+        return TRUE;
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(out->socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "hfetch: socket path %s is too long\n", out->socket_path);
+        return FALSE;
+    }
+    strcpy(address.sun_path, out->socket_path);
+    out->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (out->fd < 0 || connect(out->fd, (struct sockaddr *)&address, sizeof(address))) {
+        fprintf(stderr, "hfetch: cannot connect to %s: %s\n", out->socket_path, strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Sends one record, FALSE once the reader went away
+BOOL write_metrics(metrics_output *out, const stats_snapshot *snapshot) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t time_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+    out->buffer.length = 0;
+    if (out->format == METRICS_JSON)
+        encode_json_record(&out->buffer, snapshot, out->sequence, time_ms);
+    else
+        encode_binary_record(&out->buffer, snapshot, out->sequence, time_ms);
+    out->sequence++;
+
+    size_t sent = 0;
+    while (sent < out->buffer.length) {
+        ssize_t n = write(out->fd, out->buffer.data + sent, out->buffer.length - sent);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        sent += n;
+    }
+    out->bytes += sent;
+    return TRUE;
+}
+
+#ifdef HFETCH_PROFILE
+void print_latency(const char *kind, const char *name, const latency_histogram *histogram) {
+    if (!histogram->count)
+        return;
+    printf("%-9s %-10s %8zu %10.1f %10.1f %10.1f\n", kind, name, histogram->count,
+        histogram_percentile(histogram, 0.50) / 1e3, histogram_percentile(histogram, 0.99) / 1e3,
+        histogram->max_ns / 1e3);
+}
+
+// Latencies are bucket lower bounds, within 12.5% of the real value
+void print_profile() {
+    printf("%-20s %8s %10s %10s %10s\n", "Latency (us)", "samples", "p50", "p99", "max");
+    for (size_t i = 0; i < COLLECTOR_COUNT; i++)
+        print_latency("collector", collectors[i].name, &collectors[i].latency);
+    for (int i = 0; i < PHASE_COUNT; i++)
+        print_latency("render", phase_names[i], &phase_latency[i]);
+
+    const proc_source *sources[] = { &stat_source, &meminfo_source, &mounts_source, &battery_source };
+    size_t opens = 0, reads = 0, spawns = 0;
+    for (size_t i = 0; i < sizeof(sources) / sizeof(*sources); i++) {
+        opens += sources[i]->open_calls;
+        reads += sources[i]->read_calls;
+    }
+    for (size_t i = 0; i < drm_card_count; i++) {
+        const proc_source *card[] = { &drm_cards[i].vram_used, &drm_cards[i].vram_total, &drm_cards[i].busy_percent };
+        for (size_t j = 0; j < sizeof(card) / sizeof(*card); j++) {
+            opens += card[j]->open_calls;
+            reads += card[j]->read_calls;
+        }
+    }
+    for (size_t i = 0; i < GPU_SESSION_COUNT; i++) {
+        reads += gpu_sessions[i].stream.read_calls;
+        spawns += gpu_sessions[i].stream.spawn_count;
+    }
+    printf("Syscalls: open %zu, read %zu, write %zu, statvfs %zu, getdents64 %zu, poll %zu, ioctl %zu, posix_spawn %zu\n",
+        opens, reads, write_calls, atomic_load(&statvfs_calls), atomic_load(&getdents_calls),
+        atomic_load(&poll_calls), geometry.refresh_count, spawns);
+    printf("Bytes written to the terminal: %zu in %zu frames\n", output_bytes, frame_count);
+}
+#endif
+
+// Draws the last frame and gives the terminal back, once the render loop has
+// stopped. Signal handlers only ask for this through stopprog.
+void finish_animation() {
+    begin_frame();
+    clear_screen();
+    print_stats(&sysstats, acquire_snapshot(&sysstats));
+    print_logo();
+    // Leave the cursor below whichever is taller, the logo or the stats
+    int bottom = stats_cache.line_count > cliorb.height ? stats_cache.line_count : cliorb.height;
+    emit(POS "\n" SHOWCURSOR, bottom, 1);
+    disable_focus_reporting();
+    end_frame();
+
+    if (sysstats.flags.print_debug_counters)
+        print_debug_counters();
+#ifdef HFETCH_PROFILE
+    if (sysstats.flags.print_profile)
+        print_profile();
+#endif
+    stop_gpu_sessions();
+}
+
+static volatile sig_atomic_t stopprog = 0;
 
 
 void* handle_dynamic_stats(void* data)
 {
+	system_stats* stats = data;
 	while(!stopprog)
 	{
-		update_dynamic_stats((system_stats*)data);
-		usleep(200000);
+		if(shared)
+		{
+			if(update_shared_stats(stats))
+				continue;
+			// The daemon went away, sample locally from here on
+			detach_shared_stats();
+			stats->working.ready = 0;
+			start_local_stats(stats, FALSE);
+			copy_snapshot(&stats->snapshots[stats->back], &stats->working);
+			publish_snapshot(stats);
+		}
+		update_dynamic_stats(stats);
 	}
 	return NULL;
 }
 
+void handle_stop(int signal) {
+    UNUSED_ARG(signal);
+    stopprog = 1;
+}
+
+// Samples for every other instance on the host. The heartbeat is written on
+// each wakeup, at least every SHARED_STATS_STALE_MS / 2 whatever the collector
+// intervals, so clients notice a daemon that hangs or dies. The snapshot is
+// only written when a collector ran.
+int run_daemon(system_stats *stats) {
+    shared_stats *segment = create_shared_stats();
+    if (!segment)
+        return 1;
+
+    max_stats_sleep_ns = SHARED_STATS_STALE_MS / 2 * 1000000LL;
+    fetch_stats(stats);
+    size_t written = (size_t)-1;
+    while (!stopprog) {
+        // The working snapshot may still be grown by the startup jobs, the
+        // published one only holds the tables of finished collectors
+        const stats_snapshot *snapshot = acquire_snapshot(stats);
+        if (written != dynamic_refresh_count || snapshot->ready != segment->ready) {
+            write_shared_stats(segment, snapshot);
+            written = dynamic_refresh_count;
+        }
+        atomic_store_explicit(&segment->heartbeat_ns, monotonic_ns(), memory_order_relaxed);
+        update_dynamic_stats(stats);
+    }
+
+    shm_unlink(SHARED_STATS_NAME);
+    munmap(segment, sizeof(shared_stats));
+    if (stats->flags.print_debug_counters)
+        print_debug_counters();
+    stop_gpu_sessions();
+    return 0;
+}
+
+// Streams a record of the latest snapshot every period until interrupted or
+// until the reader goes away. The collectors keep their own intervals, a
+// faster rate only repeats the snapshot more often.
+int run_metrics(system_stats *stats) {
+    if (!open_metrics_output(&metrics))
+        return 1;
+    signal(SIGPIPE, SIG_IGN); // A closed reader fails the next write() instead
+
+    fetch_stats(stats);
+    BOOL written = TRUE;
+    if (stats->flags.once) {
+        written = write_metrics(&metrics, &stats->working);
+    } else {
+        pthread_t dynamicstats;
+        pthread_create(&dynamicstats, NULL, handle_dynamic_stats, stats);
+        long long deadline = monotonic_ns();
+        while (!stopprog && (written = write_metrics(&metrics, acquire_snapshot(stats)))) {
+            deadline += metrics.period_ns;
+            // Skip the periods a slow reader held us up for instead of bursting
+            long long behind = monotonic_ns() - deadline;
+            if (behind > 0) {
+                size_t missed = behind / metrics.period_ns + 1;
+                metrics.skipped_periods += missed;
+                deadline += missed * metrics.period_ns;
+            }
+            struct timespec wake = { deadline / 1000000000LL, deadline % 1000000000LL };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR && !stopprog);
+        }
+        stopprog = 1;
+        pthread_join(dynamicstats, NULL);
+    }
+
+    if (stats->flags.print_debug_counters) {
+        // stdout may be carrying the records
+        fflush(stdout);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        print_debug_counters();
+    }
+    stop_gpu_sessions();
+    return written ? 0 : 1;
+}
+
+#ifndef HFETCH_NO_MAIN
 int main(int argc, char** argv) {
-    signal(SIGINT, handle_exit);
-    system("tput civis");
+    clock_gettime(CLOCK_MONOTONIC, &program_start);
+    color_mode logo_color_mode = detect_color_mode();
+    // Every way of being asked to stop goes through the loop, so the tty is restored
+    signal(SIGINT, handle_stop);
+    signal(SIGTERM, handle_stop);
+    signal(SIGHUP, handle_stop);
+    signal(SIGQUIT, handle_stop);
+    signal(SIGWINCH, handle_winch);
 
     for(int i=1;i<argc;i++)
     {
@@ -756,38 +2914,124 @@ int main(int argc, char** argv) {
             sysstats.flags.disable_print_disk_usage = TRUE;
 		else if(strcmp(argv[i],"-ng")==0)
 			sysstats.flags.disable_print_gpu = TRUE;		
+        else if(strcmp(argv[i],"--debug")==0)
+            sysstats.flags.print_debug_counters = TRUE;
+        else if(strcmp(argv[i],"--profile")==0)
+#ifdef HFETCH_PROFILE
+            sysstats.flags.print_profile = TRUE;
+#else
+            fprintf(stderr,"--profile needs a build with HFETCH_PROFILE defined (make hfetch-profile)\n");
+#endif
+        else if(strcmp(argv[i],"--once")==0)
+            sysstats.flags.once = TRUE;
+        else if(strcmp(argv[i],"--gpu-tools")==0)
+            sysstats.flags.gpu_tools = TRUE;
+        else if(strcmp(argv[i],"--daemon")==0)
+            sysstats.flags.daemon = TRUE;
+        else if(strcmp(argv[i],"--local")==0)
+            sysstats.flags.local = TRUE;
+        else if(strcmp(argv[i],"--output")==0 && i+1<argc)
+        {
+            i++;
+            if(strcmp(argv[i],"json")==0)
+                metrics.format = METRICS_JSON;
+            else if(strcmp(argv[i],"binary")==0)
+                metrics.format = METRICS_BINARY;
+            else
+                fprintf(stderr,"Unknown output format %s, expected json or binary\n",argv[i]);
+        }
+        else if(strcmp(argv[i],"--rate")==0 && i+1<argc)
+        {
+            long period_ms = atol(argv[++i]);
+            if(period_ms > 0 && period_ms <= 3600000)
+                metrics.period_ns = period_ms * 1000000LL;
+            else
+                fprintf(stderr,"Invalid rate %s, expected 1 to 3600000 ms\n",argv[i]);
+        }
+        else if(strcmp(argv[i],"--socket")==0 && i+1<argc)
+            metrics.socket_path = argv[++i];
+        else if(strcmp(argv[i],"--fps")==0 && i+1<argc)
+        {
+            long fps = atol(argv[++i]);
+            if(fps > 0 && fps <= 1000)
+                pacer.period_ns = 1000000000LL / fps;
+            else
+                fprintf(stderr,"Invalid frame rate %s, expected 1 to 1000\n",argv[i]);
+        }
+        else if(strcmp(argv[i],"--interval")==0 && i+1<argc)
+        {
+            if(!parse_collector_interval(argv[++i]))
+                fprintf(stderr,"Invalid interval %s, expected name=ms\n",argv[i]);
+        }
+        else if(strcmp(argv[i],"--color")==0 && i+1<argc)
+        {
+            if(!parse_color_mode(argv[++i],&logo_color_mode))
+                fprintf(stderr,"Unknown color mode %s, expected truecolor, 256 or 16\n",argv[i]);
+        }
+    }
+    if(sysstats.flags.daemon)
+        return run_daemon(&sysstats);
+    if(!sysstats.flags.local)
+        shared = attach_shared_stats();
+    if(metrics.format != METRICS_NONE)
+        return run_metrics(&sysstats);
+    if(sysstats.flags.once)
+    {
+        // Nothing to restore, the frame is drawn in one write
+        signal(SIGINT,SIG_DFL);
+        signal(SIGTERM,SIG_DFL);
+        signal(SIGHUP,SIG_DFL);
+        signal(SIGQUIT,SIG_DFL);
+        set_frame_color_mode(&cliorb,logo_color_mode);
+        fetch_stats(&sysstats);
+        print_once(&sysstats);
+        if(sysstats.flags.print_debug_counters)
+            print_debug_counters();
+#ifdef HFETCH_PROFILE
+        if(sysstats.flags.print_profile)
+            print_profile();
+#endif
+        stop_gpu_sessions();
+        return 0;
     }
+    set_animation_color_mode(&cliorb,logo_color_mode);
+    synchronized_output = detect_synchronized_output();
 
     fetch_stats(&sysstats);
 	pthread_t dynamicstats;
 	pthread_create(&dynamicstats,NULL,handle_dynamic_stats,&sysstats);
 ///*
-    size_t frame = 0;
     int prev_columns = 0, prev_lines = 0;
     int columns, lines;
-    while (1) {
+    begin_frame();
+    emit(HIDECURSOR);
+    enable_focus_reporting();
+    pacer.deadline_ns = monotonic_ns();
+    while (!stopprog) {
+        long long frame_start = monotonic_ns();
         get_terminal_size(&columns, &lines);
-        if (prev_columns != columns || prev_lines != lines) {
-            clear_screen(columns, lines);
+        if (prev_columns != columns || prev_lines != lines || screen_stale) {
+            screen_stale = 0;
+            clear_screen();
             prev_columns = columns;
             prev_lines = lines;
         }
+        PROFILE_END(&phase_latency[PHASE_GEOMETRY], frame_start);
 
-		if(pthread_mutex_trylock(&sysstats.mutex))
-		{
-        	print_stats(sysstats);
-			pthread_mutex_unlock(&sysstats.mutex);
-		}
+        PROFILE_BEGIN(stats_start);
+		print_stats(&sysstats, acquire_snapshot(&sysstats));
+        PROFILE_END(&phase_latency[PHASE_STATS], stats_start);
+        PROFILE_BEGIN(logo_start);
         print_logo();
-        fflush(stdout);
-        /* if (frame % (FPS / 4) == 0) // update stats every 0.25s
-            update_dynamic_stats(&sysstats); */
-        usleep(1000000 / FPS);
-        frame++;
+        PROFILE_END(&phase_latency[PHASE_LOGO], logo_start);
+        long long write_start = monotonic_ns();
+        end_frame();
+        PROFILE_END(&phase_latency[PHASE_WRITE], write_start);
+        pace_frame(&pacer, frame_start, write_start);
     }
-	stopprog = 1;
 	pthread_join(dynamicstats,NULL);
-    handle_exit(0);
+    finish_animation();
 //*/
     return 0;
 }
+#endif // HFETCH_NO_MAIN
@@ -2,9 +2,18 @@
 #define HFETCH_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
 
 #define BUFFERSIZE 256 // Default length for all used buffers
 #define PADDING 44     // Cliorb size
@@ -15,6 +24,10 @@
 #define COLOR_CYAN "\033[38;5;14m"
 #define COLOR_RESET "\033[0m"
 #define POS "\033[%d;%dH" // Move cursor to y;x 
+#define ERASELINE "\033[K"  // Erase from the cursor to the end of the line
+#define COLUMN "\033[%dG"   // Move cursor to column x of the current line
+#define HIDECURSOR "\033[?25l"
+#define SHOWCURSOR "\033[?25h"
 
 #define NULL_RETURN(ptr) do { if (ptr == NULL) return; } while (0)
 #define UNUSED_ARG(arg) do { (void)(arg); } while (0)
@@ -23,99 +36,721 @@ typedef __uint8_t BOOL;
 #define TRUE 1
 #define FALSE 0
 
+// Fields of /proc/meminfo, all in kB except the HugePages_ page counts
+typedef struct meminfo_snapshot {
+    size_t mem_total_kB,
+           mem_free_kB,
+           mem_available_kB,
+           buffers_kB,
+           cached_kB,
+           swap_total_kB,
+           swap_free_kB,
+           dirty_kB,
+           shmem_kB,
+           hugepages_total,
+           hugepages_free,
+           hugepage_size_kB;
+    unsigned int present; // MEMINFO_* bits of the fields that were found
+} meminfo_snapshot;
+
+#define MEMINFO_MEM_TOTAL       (1u << 0)
+#define MEMINFO_MEM_FREE        (1u << 1)
+#define MEMINFO_MEM_AVAILABLE   (1u << 2)
+#define MEMINFO_BUFFERS         (1u << 3)
+#define MEMINFO_CACHED          (1u << 4)
+#define MEMINFO_SWAP_TOTAL      (1u << 5)
+#define MEMINFO_SWAP_FREE       (1u << 6)
+#define MEMINFO_DIRTY           (1u << 7)
+#define MEMINFO_SHMEM           (1u << 8)
+#define MEMINFO_HUGEPAGES_TOTAL (1u << 9)
+#define MEMINFO_HUGEPAGES_FREE  (1u << 10)
+#define MEMINFO_HUGEPAGE_SIZE   (1u << 11)
+
+typedef struct disk_stats {
+    char device[BUFFERSIZE],
+         mount_point[BUFFERSIZE];
+    size_t used_bytes, total_bytes; // Total is 0 when unknown
+    BOOL stale; // statvfs() missed its deadline, the values are from an earlier refresh
+} disk_stats;
+
+#define DISK_WORKERS 4
+#define DISK_SAMPLE_DEADLINE_MS 250
+
+// Last statvfs() result of a mount point. Samples are allocated once per
+// mount point and never moved, a worker may still be writing to one long
+// after the refresh that queued it gave up on it.
+typedef struct disk_sample {
+    char mount_point[BUFFERSIZE];
+    size_t used_bytes, total_bytes;
+    BOOL sampled;   // Has a value from some refresh
+    BOOL in_flight; // Queued or being sampled by a worker
+    BOOL removed;   // Unmounted while in flight, the worker frees it
+    size_t generation; // Last refresh that listed the mount point
+    struct disk_sample *next; // Queue link
+} disk_sample;
+
+// statvfs() runs on a small pool of workers so a hung network or FUSE mount
+// only ties up one worker instead of the stats thread
+typedef struct disk_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t work, done;
+    disk_sample *head, *tail;
+    disk_sample **samples;
+    size_t sample_count, sample_capacity;
+    BOOL started;
+    size_t generation; // Refreshes so far
+    size_t stale_count; // Counter
+} disk_pool;
+
+typedef struct mount_entry {
+    char device[BUFFERSIZE],
+         mount_point[BUFFERSIZE];
+} mount_entry;
+
+// Filtered block device mounts, kept between refreshes and only parsed again
+// after the kernel reports a change
+typedef struct mount_table {
+    mount_entry *entries;
+    size_t count, capacity;
+    size_t parse_count;
+} mount_table;
+
+typedef struct gpu_stats {
+    char name[BUFFERSIZE];
+    size_t vram_used_mib, vram_total_mib; // Total is 0 when unknown
+    int activity;                         // Percent, negative when unknown
+} gpu_stats;
+
+#define CPU_STRIP_WIDTH 32 // Characters of the per-core heat strip
+
+// /proc/stat counters of every core kept as separate arrays, so that the
+// deltas of all cores are computed in one loop the compiler can vectorize
+typedef struct cpu_counters {
+    size_t count, capacity;
+    uint64_t *busy, *total;           // Latest sample, in clock ticks
+    uint64_t *prev_busy, *prev_total; // Sample before it
+    uint64_t aggregate_busy, aggregate_total, prev_aggregate_busy, prev_aggregate_total;
+} cpu_counters;
+
+// Field groups of a snapshot, one per collector
+#define SNAPSHOT_DATETIME  (1u << 0)
+#define SNAPSHOT_UPTIME    (1u << 1)
+#define SNAPSHOT_CPU       (1u << 2)
+#define SNAPSHOT_MEMORY    (1u << 3)
+#define SNAPSHOT_PROCESSES (1u << 4)
+#define SNAPSHOT_BATTERY   (1u << 5)
+#define SNAPSHOT_GPUS      (1u << 6)
+#define SNAPSHOT_DISKS     (1u << 7)
+
+// Everything the stats thread refreshes. Values are kept raw and only
+// formatted when drawn, the disk and GPU tables grow as needed and are reused.
+typedef struct stats_snapshot {
+    time_t datetime;
+    double cpu_usage;     // Percent, negative when unknown
+    float *core_usage;    // Busy fraction of every core
+    size_t core_count, core_capacity;
+    meminfo_snapshot meminfo;
+    long process_count;   // Negative when unknown
+    long uptime;          // Seconds, negative when unknown
+    int battery_charge;   // Percent, negative without a battery
+    disk_stats *disks;
+    size_t disk_count, disk_capacity;
+    gpu_stats *gpus;
+    size_t gpu_count, gpu_capacity;
+    unsigned ready;       // SNAPSHOT_* fields collected at least once, only these are copied
+} stats_snapshot;
+
 typedef struct system_stats {
     char user_name[BUFFERSIZE],
          host_name[BUFFERSIZE],
-         datetime[BUFFERSIZE],
          os_name[BUFFERSIZE],
          kernel_version[BUFFERSIZE],
          desktop_name[BUFFERSIZE],
          shell_name[BUFFERSIZE],
          terminal_name[BUFFERSIZE],
-         cpu_name[BUFFERSIZE],
-         cpu_usage[BUFFERSIZE],
-         ram_usage[BUFFERSIZE],
-         swap_usage[BUFFERSIZE],
-         process_count[BUFFERSIZE],
-         uptime[BUFFERSIZE],
-         battery_charge[BUFFERSIZE],
-         disk_usage[BUFFERSIZE][2][BUFFERSIZE],
-         gpu_stats[BUFFERSIZE][3][BUFFERSIZE];
-    size_t mount_count,gpu_count;
+         cpu_name[BUFFERSIZE];
     struct
     {
         BOOL disable_print_disk_usage : 1;
 		BOOL disable_print_gpu : 1;
+        BOOL print_debug_counters : 1;
+        BOOL once : 1;      // Print a single frame and exit
+        BOOL gpu_tools : 1; // Let --once start amdgpu_top/nvidia-smi
+        BOOL print_profile : 1;
+        BOOL daemon : 1;    // Sample for other instances instead of rendering
+        BOOL local : 1;     // Sample locally even when a daemon is running
     } flags;
-	pthread_mutex_t mutex;
+    // Collectors write into working, which is copied into the back snapshot
+    // when something changed. Triple buffered from there, see
+    // publish_snapshot() and acquire_snapshot(). The stats thread owns back,
+    // the render loop owns front and the two only meet in an atomic exchange
+    // of the middle index.
+    stats_snapshot working;
+    stats_snapshot snapshots[3];
+    unsigned int back, front;
+    atomic_uint middle; // Index, ORed with SNAPSHOT_FRESH when not yet acquired
 } system_stats;
 
+#define SNAPSHOT_FRESH 4u
+
+typedef struct terminal_geometry {
+    int columns, lines;
+    size_t refresh_count; // How many times the tty was actually queried
+} terminal_geometry;
+
+#define STATS_MAX_LINES 128              // Stats lines tracked by the render cache
+#define STATS_LINE_SIZE (BUFFERSIZE * 3) // Longest stats line including escapes
+
+typedef struct render_cache {
+    char lines[STATS_MAX_LINES][STATS_LINE_SIZE];
+    int line_count;  // Lines drawn by the previous frame
+    BOOL invalid;    // Screen was cleared, every line must be repainted
+    BOOL detached;   // Only record the lines, the caller lays them out
+} render_cache;
+
+#define IDLE_FPS 2            // Frame rate while the terminal is unfocused or output is blocked
+#define BLOCKED_WRITE_MS 100 // A frame write() taking longer means output is blocked
+
+// Timing of the render loop, all times in ns on CLOCK_MONOTONIC
+typedef struct frame_pacer {
+    long long period_ns;
+    long long deadline_ns; // When the next frame is due
+    BOOL unfocused, blocked;
+    size_t frames, late_frames, skipped_frames, idle_frames;
+    long long render_min_ns, render_max_ns, render_total_ns;
+} frame_pacer;
+
+// One character of the animation, a lower half block colored with fg on a bg
+// background. Both are palette indices, index 0 marks a transparent cell.
+typedef struct animation_cell {
+    uint16_t fg, bg;
+} animation_cell;
+
+#define ANIMATION_TRANSPARENT 0
+
+typedef enum color_mode {
+    COLOR_MODE_TRUECOLOR, // \033[38;2;R;G;Bm
+    COLOR_MODE_256,       // \033[38;5;Nm, xterm-256 palette
+    COLOR_MODE_16,        // \033[3Nm / \033[9Nm, basic ANSI colors
+} color_mode;
+
+// Frames are stored as cells and turned into escape sequences at runtime, the
+// first frame drawn is a complete repaint and later ones only repaint the
+// cells that changed since the previous frame, unless a repaint is shorter
 typedef struct animation_object {
     size_t current_frame;
     size_t frame_count;
-    char *frames[];
+    int width, height;
+    const uint8_t (*palette)[3];  // RGB
+    size_t palette_size;
+    const animation_cell *cells;  // frame_count * height * width
+    BOOL keyframe_drawn;
+    size_t drawn_frame;           // Frame on screen, deltas are encoded against it
+    color_mode mode;
+    uint8_t *quantized;           // Palette index to xterm color, NULL in truecolor mode
+    size_t *keyframe_bytes;       // Repaint size of every frame in this mode, 0 until measured
 } animation_object;
 
-typedef struct dynamic_string {
+// Length-tracked byte buffer, used for composing escape sequences and for
+// collecting tool output. It is reused rather than freed, so it only grows
+// until it fits the largest contents.
+typedef struct output_buffer {
     size_t reserved_size;
-    char* str;
-} dynamic_string;
+    size_t length;
+    char* data;
+} output_buffer;
 
-void reserve_dynamic_string(dynamic_string* dyn_str, size_t n)
+void reserve_output_buffer(output_buffer* out, size_t n)
 {
-    NULL_RETURN(dyn_str);
-    if(n==0)
+    if(out->length + n <= out->reserved_size)
     {
         return;
     }
-    const size_t combined_length = dyn_str->reserved_size+n;
-    int reserve_more = 0;
-    while(dyn_str->reserved_size<combined_length)
+    if(out->reserved_size == 0)
     {
-        dyn_str->reserved_size*=2;
-        reserve_more = 1;
+        out->reserved_size = 4096;
     }
-    if(reserve_more)
+    while(out->reserved_size < out->length + n)
     {
-        dyn_str->str = realloc(dyn_str->str,dyn_str->reserved_size);
+        out->reserved_size *= 2;
     }
+    out->data = realloc(out->data, out->reserved_size);
 }
 
-void append_dynamic_string(dynamic_string* dest, const char* src)
+void append_output_buffer(output_buffer* out, const char* src, size_t n)
 {
-    NULL_RETURN(src);
-    NULL_RETURN(dest);
-    const size_t source_length = strlen(src);
-    const size_t dest_length = strlen(dest->str);
-    const size_t combined_length = source_length+dest_length+1;
-    if(combined_length >= dest->reserved_size)
-    {
-        while(dest->reserved_size <= combined_length)
+    reserve_output_buffer(out, n);
+    memcpy(out->data + out->length, src, n);
+    out->length += n;
+}
+
+// A pseudo-file (procfs/sysfs) that is opened once and re-read from offset 0
+// with pread() into a buffer that is reused between refreshes
+typedef struct proc_source {
+    const char* path;
+    int fd;
+    BOOL open_failed;
+    size_t reserved_size;
+    size_t length;
+    char* buffer;
+    size_t open_calls, read_calls; // Syscall counters
+} proc_source;
+
+#define PROC_SOURCE(source_path) { .path = (source_path), .fd = -1 }
+
+// Returns TRUE and leaves the NUL-terminated contents in src->buffer on success
+BOOL read_proc_source(proc_source* src)
+{
+    if(src->fd < 0)
+    {
+        if(src->open_failed)
+        {
+            return FALSE;
+        }
+        src->open_calls++;
+        src->fd = open(src->path, O_RDONLY | O_CLOEXEC);
+        if(src->fd < 0)
+        {
+            src->open_failed = TRUE;
+            return FALSE;
+        }
+    }
+    if(src->buffer == NULL)
+    {
+        src->reserved_size = 4096;
+        src->buffer = malloc(src->reserved_size);
+    }
+    src->length = 0;
+    while(1)
+    {
+        if(src->length + 1 >= src->reserved_size)
+        {
+            src->reserved_size *= 2;
+            src->buffer = realloc(src->buffer, src->reserved_size);
+        }
+        const size_t wanted = src->reserved_size - src->length - 1;
+        src->read_calls++;
+        ssize_t n = pread(src->fd, src->buffer + src->length, wanted, src->length);
+        if(n < 0)
         {
-            dest->reserved_size *= 2;
+            src->length = 0;
+            src->buffer[0] = '\0';
+            return FALSE;
         }
-        dest->str = realloc(dest->str,dest->reserved_size);
+        // seq_file hands back about a page per read whatever the size asked
+        // for, so a short read is not the end of the file, only 0 is
+        if(n == 0)
+        {
+            break;
+        }
+        src->length += n;
+    }
+    src->buffer[src->length] = '\0';
+    return TRUE;
+}
+
+void close_proc_source(proc_source* src)
+{
+    if(src->fd >= 0)
+    {
+        close(src->fd);
+    }
+    free(src->buffer);
+    src->fd = -1;
+    src->buffer = NULL;
+    src->reserved_size = 0;
+}
+
+// A long-lived child process (e.g. a monitoring tool in its loop mode) whose
+// stdout is read through a nonblocking pipe. Bytes of records that are not
+// complete yet stay in pending until the next read.
+typedef struct stream_session {
+    pid_t pid;
+    int fd;
+    BOOL failed;
+    output_buffer pending;
+    size_t spawn_count, read_calls, record_count; // Counters
+} stream_session;
+
+#define STREAM_SESSION { .pid = -1, .fd = -1 }
+
+extern char** environ;
+
+// Starts argv[0] from PATH with stdout on a pipe and stdin/stderr on /dev/null
+BOOL start_stream_session(stream_session* session, char* const argv[])
+{
+    int fds[2];
+    if(pipe(fds) < 0)
+    {
+        session->failed = TRUE;
+        return FALSE;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    int error = posix_spawnp(&session->pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if(error)
+    {
+        close(fds[0]);
+        session->pid = -1;
+        session->failed = TRUE;
+        return FALSE;
     }
-    strncat(dest->str,src,source_length);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    session->fd = fds[0];
+    session->pending.length = 0;
+    session->spawn_count++;
+    return TRUE;
 }
 
-dynamic_string new_dynamic_string(const char* init)
+void stop_stream_session(stream_session* session)
 {
-    dynamic_string ret_string;
-    const size_t init_length = strlen(init);
-    ret_string.reserved_size = 1;
-    while(ret_string.reserved_size <= init_length)
+    if(session->fd >= 0)
     {
-        ret_string.reserved_size *= 2;
+        close(session->fd);
+        session->fd = -1;
+    }
+    if(session->pid > 0)
+    {
+        kill(session->pid, SIGTERM);
+        waitpid(session->pid, NULL, 0);
+        session->pid = -1;
     }
-    ret_string.str = malloc(ret_string.reserved_size);
-    strncpy(ret_string.str,init,init_length);
-    return ret_string;
 }
 
-void free_dynamic_string(dynamic_string* dyn_str)
+// Appends whatever the child has written so far to pending without blocking.
+// Returns FALSE once the child has closed its end of the pipe.
+BOOL read_stream_session(stream_session* session)
 {
-    free(dyn_str->str);
+    if(session->fd < 0)
+    {
+        return FALSE;
+    }
+    while(1)
+    {
+        reserve_output_buffer(&session->pending, 4096);
+        session->read_calls++;
+        ssize_t n = read(session->fd, session->pending.data + session->pending.length,
+            session->pending.reserved_size - session->pending.length);
+        if(n > 0)
+        {
+            session->pending.length += n;
+            continue;
+        }
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n < 0 && errno == EAGAIN)
+        {
+            return TRUE;
+        }
+        stop_stream_session(session);
+        return FALSE;
+    }
 }
 
+// Drops the first n bytes of pending, they belonged to records already parsed
+void consume_stream_session(stream_session* session, size_t n)
+{
+    memmove(session->pending.data, session->pending.data + n, session->pending.length - n);
+    session->pending.length -= n;
+}
+
+#define GPU_SESSION_MAX_GPUS 16
+#define PCI_BUS_ID_SIZE 20 // "0000:03:00.0", empty when unknown
+#define GPU_SESSION_WAIT_MS 2000 // How long --once waits for the first records
+
+// A GPU monitoring tool kept running in its loop mode, gpus holds the values
+// from its latest records
+typedef struct gpu_session {
+    char* const* argv;
+    const char* vendor; // PCI vendor id of the cards the tool reports on
+    stream_session stream;
+    size_t (*record_end)(const char* data, size_t length); // 0 while incomplete
+    void (*parse_record)(struct gpu_session* session, char* record);
+    gpu_stats gpus[GPU_SESSION_MAX_GPUS];
+    char bus_ids[GPU_SESSION_MAX_GPUS][PCI_BUS_ID_SIZE]; // Of gpus, to skip the cards sysfs covers
+    size_t gpu_count;
+    BOOL produced; // A record was parsed since the tool was started
+} gpu_session;
+
+#define DRM_MAX_CARDS 16
+
+// A /sys/class/drm card, its attributes are kept open and re-read with pread()
+typedef struct drm_card {
+    char name[BUFFERSIZE];
+    char vendor[8];
+    char bus_id[PCI_BUS_ID_SIZE];
+    BOOL has_data; // Exposes VRAM or busy attributes, otherwise left to the tools
+    char paths[3][BUFFERSIZE];
+    proc_source vram_used, vram_total, busy_percent;
+} drm_card;
+
+#ifdef HFETCH_PROFILE
+// Log-linear latency histogram: below 8ns every value has its own bucket,
+// above that every power of two is split into 8 linear buckets, so a bucket
+// is at most 12.5% wide whatever the magnitude
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+typedef struct latency_histogram {
+    uint32_t counts[HISTOGRAM_BUCKETS];
+    size_t count;
+    uint64_t max_ns;
+} latency_histogram;
+
+size_t histogram_bucket(uint64_t value)
+{
+    if(value < (1u << HISTOGRAM_SUB_BITS))
+    {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    size_t sub = (value >> (exponent - HISTOGRAM_SUB_BITS)) & ((1u << HISTOGRAM_SUB_BITS) - 1);
+    return ((size_t)(exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub;
+}
+
+// Smallest value that falls into `bucket`
+uint64_t histogram_bucket_floor(size_t bucket)
+{
+    if(bucket < (1u << HISTOGRAM_SUB_BITS))
+    {
+        return bucket;
+    }
+    int exponent = (int)(bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1u << HISTOGRAM_SUB_BITS) - 1);
+    return ((1ull << HISTOGRAM_SUB_BITS) | sub) << (exponent - HISTOGRAM_SUB_BITS);
+}
+
+void record_latency(latency_histogram* histogram, long long ns)
+{
+    uint64_t value = ns > 0 ? (uint64_t)ns : 0;
+    histogram->counts[histogram_bucket(value)]++;
+    histogram->count++;
+    if(value > histogram->max_ns)
+    {
+        histogram->max_ns = value;
+    }
+}
+
+// Lower bound of the bucket holding the `fraction` quantile
+uint64_t histogram_percentile(const latency_histogram* histogram, double fraction)
+{
+    uint64_t rank = (uint64_t)(fraction * histogram->count), seen = 0;
+    for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if(seen > rank)
+        {
+            return histogram_bucket_floor(i);
+        }
+    }
+    return histogram->max_ns;
+}
+
+typedef enum render_phase {
+    PHASE_GEOMETRY,
+    PHASE_STATS,
+    PHASE_LOGO,
+    PHASE_WRITE,
+    PHASE_COUNT
+} render_phase;
+
+#define PROFILE_BEGIN(start) long long start = monotonic_ns()
+#define PROFILE_END(histogram, start) record_latency(histogram, monotonic_ns() - (start))
+#define PROFILE_COUNT(counter) atomic_fetch_add_explicit(&(counter), 1, memory_order_relaxed)
+#else
+// Instrumentation compiles away without HFETCH_PROFILE
+#define PROFILE_BEGIN(start)
+#define PROFILE_END(histogram, start) ((void)0)
+#define PROFILE_COUNT(counter) ((void)0)
+#endif
+
+typedef enum collector_cost {
+    COLLECTOR_CHEAP,     // A syscall or a pseudo-file read
+    COLLECTOR_EXPENSIVE, // Touches every filesystem or starts a tool
+} collector_cost;
+
+// A stats collector that the stats thread refreshes on its own period
+typedef struct collector {
+    const char* name;
+    void (*collect)(stats_snapshot* snapshot);
+    unsigned fields;       // SNAPSHOT_* fields written by collect
+    collector_cost cost;
+    long interval_ms;      // 0 disables the collector
+    long long deadline_ns; // CLOCK_MONOTONIC
+    size_t run_count;
+#ifdef HFETCH_PROFILE
+    latency_histogram latency;
+#endif
+} collector;
+
+#define COLLECTOR_MAX 16
+
+// Binary min-heap of collectors ordered by deadline
+typedef struct deadline_heap {
+    collector* items[COLLECTOR_MAX];
+    size_t count;
+} deadline_heap;
+
+void push_deadline_heap(deadline_heap* heap, collector* c)
+{
+    if(heap->count == COLLECTOR_MAX)
+    {
+        return;
+    }
+    size_t i = heap->count++;
+    while(i > 0 && heap->items[(i - 1) / 2]->deadline_ns > c->deadline_ns)
+    {
+        heap->items[i] = heap->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap->items[i] = c;
+}
+
+collector* pop_deadline_heap(deadline_heap* heap)
+{
+    if(heap->count == 0)
+    {
+        return NULL;
+    }
+    collector* top = heap->items[0];
+    collector* last = heap->items[--heap->count];
+    size_t i = 0;
+    while(2 * i + 1 < heap->count)
+    {
+        size_t child = 2 * i + 1;
+        if(child + 1 < heap->count && heap->items[child + 1]->deadline_ns < heap->items[child]->deadline_ns)
+        {
+            child++;
+        }
+        if(last->deadline_ns <= heap->items[child]->deadline_ns)
+        {
+            break;
+        }
+        heap->items[i] = heap->items[child];
+        i = child;
+    }
+    heap->items[i] = last;
+    return top;
+}
+
+#define STARTUP_THREADS 4
+#define STARTUP_JOB_MAX (COLLECTOR_MAX + 8)
+
+// One fetch of the startup pass, an identity string or a collector
+typedef struct startup_job {
+    void (*fetch)(char* buffer);
+    char* buffer;
+    collector* collector;
+} startup_job;
+
+// Runs the startup pass on a few threads. Expensive collectors are queued
+// first so that they overlap with everything else, `done` tells the stats
+// thread which collectors have finished and can be handed over to it.
+typedef struct startup_pool {
+    system_stats* stats;
+    pthread_t threads[STARTUP_THREADS];
+    int thread_count;
+    BOOL joined;
+    startup_job jobs[STARTUP_JOB_MAX];
+    size_t job_count;
+    atomic_size_t next_job;
+    atomic_uint done;        // SNAPSHOT_* fields of the finished collectors
+    pthread_mutex_t mutex;
+    pthread_cond_t finished; // CLOCK_MONOTONIC
+    size_t pending[2];       // Unfinished jobs by cost, identity strings are cheap
+    long long start_ns, finished_ns[2];
+} startup_pool;
+
+// Snapshots published by `hfetch --daemon` for every instance on the host.
+// The daemon is the only writer, clients map the segment read-only and copy
+// it out under a seqlock: the sequence is odd while a snapshot is written and
+// a copy is only kept if the sequence was even and unchanged around it.
+#define SHARED_STATS_NAME "/hfetch-stats"
+#define SHARED_STATS_MAGIC 0x68667331u // "hfs1", changes with the layout
+#define SHARED_STATS_STALE_MS 3000     // A daemon that has not published for this long is gone
+#define SHARED_STATS_POLL_MS 100
+#define SHARED_MAX_DISKS 32
+#define SHARED_MAX_GPUS 16
+#define SHARED_MAX_CORES 1024
+
+typedef struct shared_stats {
+    uint32_t magic;
+    uint32_t size;            // sizeof(shared_stats) of the daemon
+    pid_t daemon_pid;
+    atomic_uint sequence;
+    atomic_llong heartbeat_ns; // CLOCK_MONOTONIC, written on every wakeup of the daemon
+    // A stats_snapshot with its tables inline
+    time_t datetime;
+    double cpu_usage;
+    meminfo_snapshot meminfo;
+    long process_count;
+    long uptime;
+    int battery_charge;
+    unsigned ready;
+    uint32_t disk_count, gpu_count, core_count;
+    disk_stats disks[SHARED_MAX_DISKS];
+    gpu_stats gpus[SHARED_MAX_GPUS];
+    float core_usage[SHARED_MAX_CORES];
+} shared_stats;
+
+// Headless output of --output, one record per --rate period
+typedef enum metrics_format {
+    METRICS_NONE,
+    METRICS_JSON,   // One JSON object per line
+    METRICS_BINARY, // metrics_record followed by its tables
+} metrics_format;
+
+#define METRICS_DEFAULT_RATE_MS 1000
+#define METRICS_RECORD_MAGIC 0x316d6668u // "hfm1" in little endian, changes with the layout
+
+// Binary records are in host byte order and only carry numbers, the names of
+// the disks and GPUs are in the JSON output. Unknown values are -1, unknown
+// totals 0, like in stats_snapshot.
+typedef struct metrics_record {
+    uint32_t magic;
+    uint32_t size;          // Bytes up to the next record, tables included
+    uint64_t sequence;
+    int64_t time_ms;        // CLOCK_REALTIME when the record was written
+    int64_t uptime;         // Seconds
+    uint64_t mem_total_kB, mem_available_kB, swap_total_kB, swap_free_kB;
+    int32_t cpu_usage;      // Hundredths of a percent
+    int32_t process_count;
+    int32_t battery_charge; // Percent
+    uint32_t ready;         // SNAPSHOT_* groups collected so far
+    uint16_t gpu_count, disk_count, core_count, reserved;
+    // Followed by gpu_count metrics_gpu, disk_count metrics_disk and
+    // core_count uint16_t core usages in hundredths of a percent
+} metrics_record;
+
+typedef struct metrics_gpu {
+    uint64_t vram_used_mib, vram_total_mib;
+    int32_t activity;
+    uint32_t reserved;
+} metrics_gpu;
+
+typedef struct metrics_disk {
+    uint64_t used_bytes, total_bytes;
+    uint32_t stale;
+    uint32_t reserved;
+} metrics_disk;
+
+typedef struct metrics_output {
+    metrics_format format;
+    const char *socket_path; // --socket, stdout when NULL
+    int fd;
+    long long period_ns;
+    uint64_t sequence;
+    output_buffer buffer; // Reused for every record
+    size_t bytes, skipped_periods; // Counters
+} metrics_output;
+
 #endif // HFETCH_H